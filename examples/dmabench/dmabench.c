@@ -0,0 +1,177 @@
+/*-
+ * Copyright (c) 2026 The pci-userspace contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure what DMA allocations cost and how much memory they pin.
+ * The program touches a heap of the given size, as a driver's process
+ * would have, and then allocates DMA blocks through the PCI hypercalls.
+ *
+ *	dmabench [-l] [-h heap MB] [-n blocks] [-s block size]
+ *
+ * -l calls mlockall(MCL_CURRENT|MCL_FUTURE) before each allocation,
+ * which is what dmalloc used to do, for comparison.
+ *
+ * The component is initialised like the rump kernel does it, through
+ * rumpcomp_pci_iospace_init(), which needs the privileges for iopl and
+ * for reading physical addresses from /proc/self/pagemap.  Without
+ * them, run it on simulated devices (see src-linux-uio/pcisim):
+ *
+ *	RUMP_PCI_SYSROOT=/dev/shm/sim RUMP_PCI_SIM=1 dmabench
+ *
+ * Reported are the time per allocation and, from /proc/self, the
+ * resident set (VmRSS), the mlocked memory (VmLck) and the hugetlb
+ * pages mapped (Private_Hugetlb and Shared_Hugetlb from smaps).  The
+ * kernel counts hugetlb pages in neither VmRSS nor VmLck, but they
+ * cannot be paged out, so "pinned" is VmLck plus hugetlb.
+ */
+
+#include <sys/mman.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pci_user.h"
+
+struct footprint {
+	unsigned long rss;
+	unsigned long lck;
+	unsigned long hugetlb;
+};
+
+/* sizes in kB */
+static void
+getfootprint(struct footprint *fp)
+{
+	char line[256];
+	unsigned long kb;
+	FILE *f;
+
+	memset(fp, 0, sizeof(*fp));
+	if ((f = fopen("/proc/self/status", "r")) == NULL)
+		err(1, "/proc/self/status");
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "VmRSS: %lu kB", &kb) == 1)
+			fp->rss = kb;
+		else if (sscanf(line, "VmLck: %lu kB", &kb) == 1)
+			fp->lck = kb;
+	}
+	fclose(f);
+
+	if ((f = fopen("/proc/self/smaps", "r")) == NULL)
+		err(1, "/proc/self/smaps");
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1
+		    || sscanf(line, "Shared_Hugetlb: %lu kB", &kb) == 1)
+			fp->hugetlb += kb;
+	}
+	fclose(f);
+}
+
+static void
+printfootprint(const char *what, const struct footprint *fp)
+{
+
+	printf("%-8s rss %8lu kB  locked %8lu kB  hugetlb %8lu kB  "
+	    "pinned %8lu kB\n", what, fp->rss, fp->lck, fp->hugetlb,
+	    fp->lck + fp->hugetlb);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: dmabench [-l] [-h heap MB] [-n blocks] "
+	    "[-s block size]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct footprint fp;
+	struct timespec start, end;
+	unsigned long pa, va;
+	size_t heapmb = 256, size = 2*1024*1024;
+	double us, totus = 0, maxus = 0;
+	int ch, i, n = 16, lockall = 0, error;
+	char *heap;
+
+	while ((ch = getopt(argc, argv, "h:ln:s:")) != -1) {
+		switch (ch) {
+		case 'h':
+			heapmb = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			lockall = 1;
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (n <= 0 || size == 0)
+		usage();
+
+	if ((error = rumpcomp_pci_iospace_init()) != 0)
+		errx(1, "pci component init: error %d", error);
+
+	if (heapmb) {
+		if ((heap = malloc(heapmb << 20)) == NULL)
+			err(1, "heap");
+		memset(heap, 1, heapmb << 20);
+	}
+	getfootprint(&fp);
+	printfootprint("start", &fp);
+
+	for (i = 0; i < n; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (lockall && mlockall(MCL_CURRENT|MCL_FUTURE) == -1)
+			err(1, "mlockall");
+		error = rumpcomp_pci_dmalloc(size, size, &pa, &va);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (error)
+			errx(1, "dmalloc %d: error %d", i, error);
+		us = (end.tv_sec - start.tv_sec) * 1e6
+		    + (end.tv_nsec - start.tv_nsec) / 1e3;
+		totus += us;
+		if (us > maxus)
+			maxus = us;
+	}
+	getfootprint(&fp);
+	printfootprint("dma", &fp);
+	printf("%d allocations of %zu bytes, %.1f us avg, %.1f us max%s\n",
+	    n, size, totus / n, maxus, lockall ? " (with mlockall)" : "");
+
+	return 0;
+}
@@ -64,6 +64,7 @@
 #include <pciaccess.h>
 
 #include "pci_user.h"
+#include "pci_user_ext.h"
 #include "experimental_U.h"
 #include <device/intr.h>
 #include "mach_debug_U.h"
@@ -173,53 +174,84 @@ found:
 	return pci_devices[i]->regions[residx].memory;
 }
 
-int
-rumpcomp_pci_confread(unsigned bus, unsigned dev, unsigned fun,
-	int reg, unsigned int *rv)
+static struct pci_device *
+pci_finddev(unsigned bus, unsigned dev, unsigned fun)
 {
 	int i;
-	*rv = 0xffffffff;
 
 	pci_userspace_init();
 
-
 	for (i = 0; i < numdevs; i++) {
 		if ((pci_devices[i]->bus == bus) &&
 		    (pci_devices[i]->dev == dev) &&
 		    (pci_devices[i]->func == fun)) {
-			goto found;
-
+			return pci_devices[i];
 		}
 	}
-	return 1;
+	return NULL;
+}
 
-found:
-	pci_device_cfg_read_u32(pci_devices[i], rv, reg);
+int
+rumpcomp_pci_confread_range(unsigned bus, unsigned dev, unsigned fun,
+	int reg, unsigned int *rv, size_t nregs)
+{
+	struct pci_device *pdev;
+	pciaddr_t nread;
+	size_t i;
+
+	for (i = 0; i < nregs; i++)
+		rv[i] = 0xffffffff;
+
+	if ((pdev = pci_finddev(bus, dev, fun)) == NULL)
+		return 1;
+
+	pci_device_cfg_read(pdev, rv, reg, nregs * sizeof(*rv), &nread);
 	return 0;
 }
 
 int
-rumpcomp_pci_confwrite(unsigned bus, unsigned dev, unsigned fun,
-	int reg, unsigned int v)
+rumpcomp_pci_confwrite_vec(unsigned bus, unsigned dev, unsigned fun,
+	const struct rumpcomp_pci_confop *ops, size_t nops)
 {
-	int i;
+	unsigned int vals[64];
+	struct pci_device *pdev;
+	pciaddr_t nwritten;
+	size_t i, n;
 
-	pci_userspace_init();
+	if ((pdev = pci_finddev(bus, dev, fun)) == NULL)
+		return 1;
 
-	for (i = 0; i < numdevs; i++) {
-		if ((pci_devices[i]->bus == bus) &&
-		    (pci_devices[i]->dev == dev) &&
-		    (pci_devices[i]->func == fun)) {
-			goto found;
+	/* write runs of consecutive registers in one go */
+	for (i = 0; i < nops; i += n) {
+		vals[0] = ops[i].val;
+		for (n = 1; i+n < nops && n < sizeof(vals)/sizeof(vals[0]); n++) {
+			if (ops[i+n].reg != ops[i].reg + 4*(int)n)
+				break;
+			vals[n] = ops[i+n].val;
 		}
+		pci_device_cfg_write(pdev, vals, ops[i].reg,
+		    n * sizeof(*vals), &nwritten);
 	}
-	return 1;
-
-found:
-	pci_device_cfg_write_u32(pci_devices[i], v, reg);
 	return 0;
 }
 
+int
+rumpcomp_pci_confread(unsigned bus, unsigned dev, unsigned fun,
+	int reg, unsigned int *rv)
+{
+
+	return rumpcomp_pci_confread_range(bus, dev, fun, reg, rv, 1);
+}
+
+int
+rumpcomp_pci_confwrite(unsigned bus, unsigned dev, unsigned fun,
+	int reg, unsigned int v)
+{
+	struct rumpcomp_pci_confop op = { .reg = reg, .val = v };
+
+	return rumpcomp_pci_confwrite_vec(bus, dev, fun, &op, 1);
+}
+
 /* this is a multifunction data structure! */
 struct irq {
 	unsigned magic_cookie;
@@ -430,16 +462,23 @@ rumpcomp_pci_dmafree(unsigned long vap, size_t size)
 
 /*
  * "maps" dma memory into virtual address space.  For now, we just
- * rely on it already being mapped.  This means that support for
- * >1 segs is not supported.  We could call mremap() ...
+ * rely on it already being mapped.  This means that >1 segs are
+ * supported only if they are already virtually contiguous, e.g.
+ * pieces of the same allocation.
  */
 int
 rumpcomp_pci_dmamem_map(struct rumpcomp_pci_dmaseg *dss, size_t nseg,
 	size_t totlen, void **vap)
 {
-	if (nseg > 1) {
-		printf("dmamem_map for >1 seg currently not supported");
-		return ENOTSUP;
+	size_t i;
+
+	for (i = 1; i < nseg; i++) {
+		if (dss[i].ds_vacookie
+		    != dss[i-1].ds_vacookie + dss[i-1].ds_len) {
+			printf("dmamem_map for >1 non-contiguous seg "
+			    "currently not supported");
+			return ENOTSUP;
+		}
 	}
 
 	*vap = (void *)dss[0].ds_vacookie;
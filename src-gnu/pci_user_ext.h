@@ -0,0 +1,18 @@
+/*
+ * Hypercalls provided by this PCI component in addition to the
+ * ones declared in pci_user.h.
+ */
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_CONFRANGE
+struct rumpcomp_pci_confop {
+	int reg;
+	unsigned int val;
+};
+
+/* read nregs consecutive 32bit registers starting from reg */
+int rumpcomp_pci_confread_range(unsigned, unsigned, unsigned,
+	int, unsigned int *, size_t);
+/* apply an array of register writes, in order */
+int rumpcomp_pci_confwrite_vec(unsigned, unsigned, unsigned,
+	const struct rumpcomp_pci_confop *, size_t);
+#endif
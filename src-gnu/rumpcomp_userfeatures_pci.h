@@ -1,2 +1,3 @@
 #define RUMPCOMP_USERFEATURE_PCI_IOSPACE
 #define RUMPCOMP_USERFEATURE_PCI_DMAFREE
+#define RUMPCOMP_USERFEATURE_PCI_CONFRANGE
@@ -23,334 +23,3678 @@
  * SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE 1
+
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/io.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT
+#endif
+#endif
 
 #include <assert.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
 #include <unistd.h>
 
 #include "pci_user.h"
+#include "pci_user_ext.h"
+#include "pcitrace.h"
 
 #include <rump/rumpuser_component.h>
 
-/* highest dev for which we've returned something sensible in config space */
 static pthread_mutex_t genericmtx = PTHREAD_MUTEX_INITIALIZER;
-static int highestdev = -1;
 static int selfmapfd = -1;
 
-int
-rumpcomp_pci_iospace_init(void)
+#define PCI_MAXDEVS 32
+#define PCI_MAXFUNCS 8
+#define PCI_NBARS 6
+
+#define PCI_CONF_NREGS		64		/* dwords in the header */
+#define PCI_CONF_BHLC		0x0c
+#define PCI_CONF_HDRTYPE(bhlc)	(((bhlc) >> 16) & 0x7f)
+
+/*
+ * Config space descriptors.  Opening the sysfs config file costs
+ * a path walk and two extra syscalls, and config space is accessed
+ * a lot during attach, so we open each device's config file once
+ * at discovery and keep it open until the process exits.
+ *
+ * In addition, we keep a shadow copy of the config header registers
+ * which do not change behind our back (IDs, class, BARs, capability
+ * pointer, etc.) and serve reads for them from memory.  A write to
+ * a shadowed register invalidates it, so e.g. BAR sizing still sees
+ * what the device returns.  Registers the device may update on its
+ * own (command/status, BIST) are always passed through.  Set
+ * RUMP_PCI_CONFSHADOW=0 in the environment to disable shadowing.
+ */
+#define CONFREG(off)		(1ULL << ((off)/4))
+/* type 0 (endpoint) header */
+#define CONFSHADOW_TYPE0	(CONFREG(0x00) | CONFREG(0x08) |	\
+				 CONFREG(0x10) | CONFREG(0x14) |	\
+				 CONFREG(0x18) | CONFREG(0x1c) |	\
+				 CONFREG(0x20) | CONFREG(0x24) |	\
+				 CONFREG(0x2c) | CONFREG(0x30) |	\
+				 CONFREG(0x34) | CONFREG(0x3c))
+/* anything else, only the registers common to all header types */
+#define CONFSHADOW_OTHER	(CONFREG(0x00) | CONFREG(0x08) |	\
+				 CONFREG(0x34))
+
+struct uioconf {
+	int fd;
+	unsigned gen;			/* bumped on each invalidation */
+	uint64_t shadowmap;		/* registers we may shadow */
+	uint64_t shadowvalid;		/* registers currently shadowed */
+	uint32_t shadow[PCI_CONF_NREGS];
+};
+
+/* resource flags from sysfs, see linux/ioport.h */
+#define IORESOURCE_IO		0x00000100
+#define IORESOURCE_MEM		0x00000200
+#define IORESOURCE_PREFETCH	0x00002000
+#define IORESOURCE_MEM_64	0x00100000
+
+/*
+ * A BAR is mapped in its entirety the first time any part of it is
+ * requested, and the mapping is shared by all later requests.  The
+ * mapping state is protected by genericmtx.
+ */
+struct uiobar {
+	unsigned long base;
+	unsigned long size;
+	unsigned long flags;
+
+	void *mem;
+	size_t maplen;
+	int refs;
+};
+
+/*
+ * Statistics.  Latencies are kept in nanoseconds in log-linear
+ * (HDR-style) histograms: values below 2^HIST_SUBBITS have a bucket
+ * each, and every power of two above that is split in 2^HIST_SUBBITS
+ * buckets, so each value is known to within 12.5%.  The counters are
+ * updated with relaxed atomics, so readers may see a slightly
+ * inconsistent snapshot.
+ */
+#define HIST_SUBBITS	3
+#define HIST_MAXBITS	40		/* about 18 minutes */
+#define HIST_NBUCKETS	((HIST_MAXBITS - HIST_SUBBITS + 1) << HIST_SUBBITS)
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_NBUCKETS];
+};
+
+struct uiostats {
+	uint64_t nspurious;		/* wakeups with nothing for us */
+	uint64_t nconfreads;
+	uint64_t nconfwrites;
+	struct hist intrlat;		/* read() return to handler entry */
+	struct hist handler;		/* handler run time */
+	struct hist schedwait;		/* in schedule + unschedule */
+	struct hist conflat;		/* config space syscalls */
+};
+
+/*
+ * Everything we know about the devices bound to uio.  The table
+ * is built once when we are first called and not changed after
+ * that, so it can be consulted without locking.
+ *
+ * The rump kernel only scans bus 0, so we present the uio devices
+ * there regardless of where they are in the host: each host slot
+ * (domain, bus, device) with at least one function bound to uio
+ * becomes a device on bus 0, and its uio-bound functions become the
+ * functions of that device.  Functions are numbered from 0 upwards,
+ * since the rump kernel will not look further if function 0 is
+ * missing.  This way all ports of a multi-function adapter can be
+ * used, also from behind bridges and in other PCI domains.
+ */
+struct uiodev {
+	int uioidx;
+	unsigned domain, bus, dev, fun;	/* host location */
+	unsigned vdev, vfun;		/* location presented on bus 0 */
+	int irq;
+	int numa_node;			/* -1 if unknown */
+	cpu_set_t localcpus;		/* CPUs close to the device */
+	int wc;				/* map prefetchable BARs WC */
+	unsigned pollusec;		/* busy-poll window, 0 if none */
+	int simfd;			/* simulated interrupt, or -1 */
+
+	/* interrupt counters, see intrthread */
+	uint64_t nwakeups;
+	uint64_t npolls;
+	uint64_t npollhits;
+	struct uiostats stats;
+	struct uiobar bars[PCI_NBARS];
+	struct uioconf conf;
+};
+static struct uiodev *uiodevs;
+static size_t nuiodevs;
+static struct uiodev *pcislots[PCI_MAXDEVS][PCI_MAXFUNCS];
+
+/* all BARs sorted by address, for looking up a device by BAR */
+struct barent {
+	unsigned long base;
+	unsigned long size;
+	struct uiodev *ud;
+	int residx;
+};
+static struct barent *bartab;
+static size_t nbartab;
+
+static pthread_once_t uioinit_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The device this thread last accessed.  dmalloc does not tell us
+ * which device the memory is for, but drivers allocate DMA memory
+ * from the same thread that attaches them, right after poking at
+ * the device, so this is a good guess.
+ */
+static __thread struct uiodev *curdev;
+
+/* histograms are not updated if RUMP_PCI_STATS=0 */
+static int statstiming = 1;
+
+static uint64_t
+stats_now(void)
 {
+	struct timespec ts;
 
-	assert(selfmapfd == -1);
-	selfmapfd = open("/proc/self/pagemap", O_RDONLY);
-	if (selfmapfd == -1)
+	if (!statstiming)
 		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	if (iopl(3) == -1) {
-		int error = rumpuser_component_errtrans(errno);
+static unsigned
+hist_bucket(uint64_t v)
+{
+	unsigned e;
+
+	if (v < (1 << HIST_SUBBITS))
+		return v;
+	e = 63 - __builtin_clzll(v);
+	if (e >= HIST_MAXBITS)
+		return HIST_NBUCKETS-1;
+	return ((e - HIST_SUBBITS + 1) << HIST_SUBBITS)
+	    + ((v >> (e - HIST_SUBBITS)) & ((1 << HIST_SUBBITS)-1));
+}
+
+static void
+hist_add(struct hist *h, uint64_t ns)
+{
+	uint64_t max;
+
+	if (!statstiming)
+		return;
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->buckets[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns,
+	    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		continue;
+}
+
+/*
+ * Flight recorder.  Every thread calling into us gets a ring of the
+ * last RUMP_PCI_TRACE_EVENTS (default 4096) events, which only that
+ * thread writes, so recording takes no locks or atomic operations.
+ * Rings are never freed, so the events of threads which have exited
+ * are kept too.  rumpcomp_pci_trace_dump() writes all rings to a file
+ * (see pcitrace.h), which pcitrace/pcitrace converts to a Chrome or
+ * Perfetto trace.  The trace is also written to RUMP_PCI_TRACE_FILE
+ * when the RUMP_PCI_STATS_SIGNAL signal arrives.  Set RUMP_PCI_TRACE=0
+ * to disable recording.
+ *
+ * Each trace point is also a USDT probe in the rumpcomp_pci provider,
+ * with the device, a0 and a1 of the event as arguments.
+ */
+struct tracering {
+	uint64_t head;			/* events written so far */
+	pid_t tid;
+	struct tracering *next;
+	struct pcitrace_ent ents[];
+};
+static struct tracering *tracerings;
+/* not genericmtx, trace points are reached with that held */
+static pthread_mutex_t tracemtx = PTHREAD_MUTEX_INITIALIZER;
+static unsigned tracenevents = 4096;
+static int traceon = 1;
+static uint64_t traceticks0, tracens0;
+static pthread_once_t traceinit_once = PTHREAD_ONCE_INIT;
+static __thread struct tracering *mytrace;
+
+#ifdef HAVE_SDT
+#define TRACE_PROBE(name, dev, a0, a1)					\
+	DTRACE_PROBE3(rumpcomp_pci, name, dev, a0, a1)
+#else
+#define TRACE_PROBE(name, dev, a0, a1)
+#endif
+
+#define TRACE(name, type, dev, a0, a1, start)				\
+do {									\
+	TRACE_PROBE(name, dev, a0, a1);					\
+	trace_event(type, dev, a0, a1, start);				\
+} while (/*CONSTCOND*/0)
+
+static uint64_t
+trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uint64_t
+trace_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+trace_init(void)
+{
+	const char *env;
+	unsigned n;
+
+	if ((env = getenv("RUMP_PCI_TRACE")) != NULL && atoi(env) == 0)
+		traceon = 0;
+	if ((env = getenv("RUMP_PCI_TRACE_EVENTS")) != NULL
+	    && (n = atoi(env)) > 0) {
+		/* round up to a power of two */
+		for (tracenevents = 1; tracenevents < n; tracenevents <<= 1)
+			continue;
+	}
+	traceticks0 = trace_clock();
+	tracens0 = trace_ns();
+}
+
+static struct tracering *
+trace_newring(void)
+{
+	struct tracering *tr;
+
+	pthread_once(&traceinit_once, trace_init);
+	if (!traceon)
+		return NULL;
+
+	tr = calloc(1, sizeof(*tr) + tracenevents * sizeof(tr->ents[0]));
+	if (tr == NULL)
+		return NULL;
+	tr->tid = syscall(SYS_gettid);
+	pthread_mutex_lock(&tracemtx);
+	tr->next = tracerings;
+	tracerings = tr;
+	pthread_mutex_unlock(&tracemtx);
+	return mytrace = tr;
+}
+
+/* record an event, lasting from start until now if start is not 0 */
+static void
+trace_event(unsigned type, unsigned dev, uint64_t a0, uint64_t a1,
+	uint64_t start)
+{
+	struct tracering *tr = mytrace;
+	struct pcitrace_ent *te;
+	uint64_t now;
+
+	if (tr == NULL && (!traceon || (tr = trace_newring()) == NULL))
+		return;
+
+	now = trace_clock();
+	te = &tr->ents[tr->head & (tracenevents-1)];
+	te->ts = start ? start : now;
+	te->dur = start ? (now - start > UINT32_MAX ? UINT32_MAX
+	    : now - start) : 0;
+	te->type = type;
+	te->dev = dev;
+	te->a0 = a0;
+	te->a1 = a1;
+	/* publish the event to the dumper */
+	__atomic_store_n(&tr->head, tr->head+1, __ATOMIC_RELEASE);
+}
+
+/* start time for trace_event, 0 if we are not tracing */
+static uint64_t
+trace_start(void)
+{
+
+	return traceon ? trace_clock() : 0;
+}
+
+int
+rumpcomp_pci_trace_dump(const char *path)
+{
+	struct pcitrace_ent *ents;
+	struct pcitrace_hdr hdr;
+	struct pcitrace_thr thr;
+	struct tracering *tr, *first;
+	uint64_t head, from, oldest, i;
+	FILE *f;
+	int error = 0;
+
+	pthread_once(&traceinit_once, trace_init);
+	if ((ents = malloc(tracenevents * sizeof(*ents))) == NULL)
+		return ENOMEM;
+	if ((f = fopen(path, "w")) == NULL) {
+		error = errno;
+		free(ents);
+		return error;
+	}
+
+	/* rings are only ever added to the head of the list */
+	pthread_mutex_lock(&tracemtx);
+	first = tracerings;
+	pthread_mutex_unlock(&tracemtx);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PCITRACE_MAGIC, sizeof(hdr.magic));
+	for (tr = first; tr != NULL; tr = tr->next)
+		hdr.nthreads++;
+	hdr.ticks0 = traceticks0;
+	hdr.ns0 = tracens0;
+	hdr.ticks1 = trace_clock();
+	hdr.ns1 = trace_ns();
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	for (tr = first; tr != NULL; tr = tr->next) {
+		/*
+		 * Copy the ring while its owner may be writing to it,
+		 * and then drop whatever it may have overwritten
+		 * meanwhile, including the slot it is writing now.
+		 */
+		head = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+		from = head > tracenevents ? head - tracenevents : 0;
+		for (i = from; i < head; i++)
+			ents[i - from] = tr->ents[i & (tracenevents-1)];
+		oldest = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE) + 1;
+		oldest = oldest > tracenevents ? oldest - tracenevents : 0;
+		if (oldest < from)
+			oldest = from;
+		if (oldest > head)
+			oldest = head;
+
+		thr.tid = tr->tid;
+		thr.nents = head - oldest;
+		fwrite(&thr, sizeof(thr), 1, f);
+		fwrite(&ents[oldest - from], sizeof(*ents), thr.nents, f);
+	}
+
+	if (ferror(f))
+		error = EIO;
+	if (fclose(f) != 0 && error == 0)
+		error = errno;
+	free(ents);
+	return error;
+}
+
+static int
+confshadow_enabled(void)
+{
+	const char *env;
+
+	env = getenv("RUMP_PCI_CONFSHADOW");
+	return env == NULL || atoi(env) != 0;
+}
+
+/*
+ * The sysfs and /dev trees are looked up under RUMP_PCI_SYSROOT, if
+ * set, so that a test can supply its own devices (see pcisim/).
+ * With RUMP_PCI_SIM=1, the devices are simulated: nobody is behind
+ * their config space and BAR files but the test, so we emulate the
+ * parts of config space semantics that drivers depend on, interrupts
+ * come from an eventfd the test fires with rumpcomp_pci_sim_intr(),
+ * and DMA addresses are plain virtual addresses.
+ */
+static const char *sysroot = "";
+static int pcisim;
+
+/* path of file in the sysfs device directory of uio device uioidx */
+static void
+uiopath(char *path, size_t len, int uioidx, const char *file)
+{
+
+	snprintf(path, len, "%s/sys/class/uio/uio%d/device%s%s",
+	    sysroot, uioidx, file ? "/" : "", file ? file : "");
+}
+
+static int
+discover_conf(struct uiodev *ud)
+{
+	const int uioidx = ud->uioidx;
+	struct uioconf *uc = &ud->conf;
+	char path[PATH_MAX];
+	uint32_t bhlc;
+	int fd;
+
+	uiopath(path, sizeof(path), uioidx, "config");
+	/* fall back to read-only so that unprivileged probing works */
+	if ((fd = open(path, O_RDWR | O_CLOEXEC)) == -1 && errno == EACCES)
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+#if 0
+		/* verbose warning */
+		warn("open config space for device %d", uioidx);
+#endif
+		return -1;
+	}
+	uc->fd = fd;
+
+	uc->shadowmap = 0;
+	if (confshadow_enabled()
+	    && pread(fd, &bhlc, sizeof(bhlc), PCI_CONF_BHLC) == sizeof(bhlc)) {
+		if (PCI_CONF_HDRTYPE(bhlc) == 0)
+			uc->shadowmap = CONFSHADOW_TYPE0;
+		else
+			uc->shadowmap = CONFSHADOW_OTHER;
+	}
+
+	return 0;
+}
+
+static void
+discover_addr(struct uiodev *ud)
+{
+	const int uioidx = ud->uioidx;
+	char path[PATH_MAX], link[PATH_MAX];
+	const char *bdf;
+	ssize_t n;
+
+	uiopath(path, sizeof(path), uioidx, NULL);
+	if ((n = readlink(path, link, sizeof(link)-1)) == -1)
+		return;
+	link[n] = '\0';
+	if ((bdf = strrchr(link, '/')) == NULL)
+		bdf = link;
+	else
+		bdf++;
+	if (sscanf(bdf, "%x:%x:%x.%x",
+	    &ud->domain, &ud->bus, &ud->dev, &ud->fun) != 4)
+		warnx("uio%d: cannot parse pci address \"%s\"", uioidx, bdf);
+}
+
+static void
+discover_bars(struct uiodev *ud)
+{
+	const int uioidx = ud->uioidx;
+	char path[PATH_MAX];
+	unsigned long long start, end, flags;
+	FILE *res;
+	int residx;
+
+	uiopath(path, sizeof(path), uioidx, "resource");
+	if ((res = fopen(path, "r")) == NULL)
+		return;
+
+	for (residx = 0; residx < PCI_NBARS
+	    && fscanf(res, "%llx %llx %llx\n", &start, &end, &flags) == 3;
+	    residx++) {
+		if (end <= start)
+			continue;
+		ud->bars[residx].base = start;
+		ud->bars[residx].size = end - start + 1;
+		ud->bars[residx].flags = flags;
+	}
+	fclose(res);
+}
+
+static void
+discover_irq(struct uiodev *ud)
+{
+	const int uioidx = ud->uioidx;
+	char path[PATH_MAX];
+	FILE *f;
+
+	ud->irq = -1;
+	uiopath(path, sizeof(path), uioidx, "irq");
+	if ((f = fopen(path, "r")) == NULL)
+		return;
+	if (fscanf(f, "%d", &ud->irq) != 1)
+		ud->irq = -1;
+	fclose(f);
+}
+
+/* parse a list of CPUs in the "0-3,8,10-11" format used by sysfs */
+static int
+parsecpus(const char *str, cpu_set_t *set)
+{
+	unsigned long lo, hi;
+	char *ep;
+
+	CPU_ZERO(set);
+	while (*str && *str != '\n') {
+		lo = hi = strtoul(str, &ep, 10);
+		if (ep == str)
+			return -1;
+		if (*ep == '-') {
+			str = ep+1;
+			hi = strtoul(str, &ep, 10);
+			if (ep == str || hi < lo)
+				return -1;
+		}
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		str = ep;
+		if (*str == ',')
+			str++;
+	}
+	return 0;
+}
+
+static void
+discover_cpus(struct uiodev *ud)
+{
+	char path[PATH_MAX], line[1024];
+	FILE *f;
+
+	CPU_ZERO(&ud->localcpus);
+	uiopath(path, sizeof(path), ud->uioidx, "local_cpulist");
+	if ((f = fopen(path, "r")) == NULL)
+		return;
+	if (fgets(line, sizeof(line), f) == NULL
+	    || parsecpus(line, &ud->localcpus) != 0)
+		CPU_ZERO(&ud->localcpus);
+	fclose(f);
+}
+
+static void
+discover_numa(struct uiodev *ud)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	ud->numa_node = -1;
+	uiopath(path, sizeof(path), ud->uioidx, "numa_node");
+	if ((f = fopen(path, "r")) == NULL)
+		return;
+	if (fscanf(f, "%d", &ud->numa_node) != 1)
+		ud->numa_node = -1;
+	fclose(f);
+}
+
+/*
+ * Check if the device is in a comma separated list of PCI addresses
+ * (e.g. "0000:03:00.0,04:00.1").  The domain may be omitted, in which
+ * case it is 0.  "all" matches every device.
+ */
+static int
+devlisted(const struct uiodev *ud, const char *list)
+{
+	unsigned domain, bus, dev, fun;
+	const char *p;
+
+	for (p = list; p != NULL; p = (p = strchr(p, ',')) ? p+1 : NULL) {
+		if (strncmp(p, "all", 3) == 0 && (p[3] == '\0' || p[3] == ','))
+			return 1;
+		if (sscanf(p, "%x:%x:%x.%x", &domain, &bus, &dev, &fun) != 4) {
+			domain = 0;
+			if (sscanf(p, "%x:%x.%x", &bus, &dev, &fun) != 3)
+				continue;
+		}
+		if (domain == ud->domain && bus == ud->bus
+		    && dev == ud->dev && fun == ud->fun)
+			return 1;
+	}
+	return 0;
+}
+
+static int
+barcmp(const void *a, const void *b)
+{
+	const struct barent *ba = a, *bb = b;
+
+	if (ba->base < bb->base)
+		return -1;
+	return ba->base > bb->base;
+}
+
+static int
+devcmp(const void *a, const void *b)
+{
+	const struct uiodev *da = a, *db = b;
+
+	if (da->domain != db->domain)
+		return da->domain < db->domain ? -1 : 1;
+	if (da->bus != db->bus)
+		return da->bus < db->bus ? -1 : 1;
+	if (da->dev != db->dev)
+		return da->dev < db->dev ? -1 : 1;
+	if (da->fun != db->fun)
+		return da->fun < db->fun ? -1 : 1;
+	return 0;
+}
+
+/* assign the bus 0 locations, see comment above struct uiodev */
+static void
+assign_slots(void)
+{
+	struct uiodev *ud, *prev = NULL;
+	unsigned vdev = 0, vfun = 0;
+	size_t i;
+
+	for (i = 0; i < nuiodevs; i++) {
+		ud = &uiodevs[i];
+		if (prev && (prev->domain != ud->domain
+		    || prev->bus != ud->bus || prev->dev != ud->dev)) {
+			vdev++;
+			vfun = 0;
+		}
+		prev = ud;
+		if (vdev >= PCI_MAXDEVS) {
+			warnx("uio%d: out of pci slots, ignoring", ud->uioidx);
+			continue;
+		}
+
+		ud->vdev = vdev;
+		ud->vfun = vfun++;
+		pcislots[ud->vdev][ud->vfun] = ud;
+		if (getenv("RUMP_VERBOSE"))
+			printf("uio%d: %04x:%02x:%02x.%x at pci bus 0 "
+			    "device %u function %u, numa node %d\n",
+			    ud->uioidx, ud->domain, ud->bus, ud->dev, ud->fun,
+			    ud->vdev, ud->vfun, ud->numa_node);
+	}
+}
+
+/* the lowest value which falls in the bucket */
+static uint64_t
+hist_lowvalue(unsigned idx)
+{
+	unsigned e;
+
+	if (idx < (1 << HIST_SUBBITS))
+		return idx;
+	e = (idx >> HIST_SUBBITS) + HIST_SUBBITS - 1;
+	return (uint64_t)((1 << HIST_SUBBITS) + (idx & ((1<<HIST_SUBBITS)-1)))
+	    << (e - HIST_SUBBITS);
+}
+
+/* the highest value which falls in the bucket */
+static uint64_t
+hist_value(unsigned idx)
+{
+
+	return hist_lowvalue(idx+1) - 1;
+}
+
+static void
+hist_summary(struct hist *h, struct rumpcomp_pci_latency *l)
+{
+	static const unsigned permille[] = { 500, 900, 990, 999 };
+	unsigned long long *pct[] =
+	    { &l->l_p50, &l->l_p90, &l->l_p99, &l->l_p999 };
+	uint64_t n, v, seen = 0;
+	unsigned i, j = 0;
+
+	memset(l, 0, sizeof(*l));
+	l->l_count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	if (l->l_count == 0)
+		return;
+	l->l_mean = __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / l->l_count;
+	l->l_max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	for (i = 0; i < HIST_NBUCKETS && j < 4; i++) {
+		n = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if (n == 0)
+			continue;
+		/*
+		 * The max is exact, the buckets are not, so don't report
+		 * anything above it.
+		 */
+		if (seen == 0) {
+			v = hist_lowvalue(i);
+			l->l_min = v < l->l_max ? v : l->l_max;
+		}
+		seen += n;
+		v = hist_value(i);
+		while (j < 4 && seen * 1000 >= l->l_count * permille[j])
+			*pct[j++] = v < l->l_max ? v : l->l_max;
+	}
+	/* buckets may have been updated after we read the count */
+	for (; j < 4; j++)
+		*pct[j] = l->l_max;
+}
+
+static void
+stats_get(struct uiodev *ud, struct rumpcomp_pci_devstats *st)
+{
+	struct uiostats *us = &ud->stats;
+
+	st->dv_intrs = __atomic_load_n(&ud->nwakeups, __ATOMIC_RELAXED);
+	st->dv_spurious = __atomic_load_n(&us->nspurious, __ATOMIC_RELAXED);
+	st->dv_confreads = __atomic_load_n(&us->nconfreads, __ATOMIC_RELAXED);
+	st->dv_confwrites =
+	    __atomic_load_n(&us->nconfwrites, __ATOMIC_RELAXED);
+	hist_summary(&us->intrlat, &st->dv_intrlat);
+	hist_summary(&us->handler, &st->dv_handler);
+	hist_summary(&us->schedwait, &st->dv_schedwait);
+	hist_summary(&us->conflat, &st->dv_conflat);
+}
+
+static void
+stats_printlat(FILE *f, const char *what,
+	const struct rumpcomp_pci_latency *l)
+{
+
+	if (l->l_count == 0)
+		return;
+	fprintf(f, "  %-10s n %llu min %llu mean %llu p50 %llu p90 %llu "
+	    "p99 %llu p99.9 %llu max %llu ns\n", what, l->l_count,
+	    l->l_min, l->l_mean, l->l_p50, l->l_p90, l->l_p99, l->l_p999,
+	    l->l_max);
+}
+
+void
+rumpcomp_pci_stats_dump(void)
+{
+	struct rumpcomp_pci_devstats st;
+	struct uiodev *ud;
+	size_t i;
+
+	for (i = 0; i < nuiodevs; i++) {
+		ud = &uiodevs[i];
+		stats_get(ud, &st);
+		fprintf(stderr, "uio%d (%04x:%02x:%02x.%x): intrs %llu "
+		    "spurious %llu confreads %llu confwrites %llu\n",
+		    ud->uioidx, ud->domain, ud->bus, ud->dev, ud->fun,
+		    st.dv_intrs, st.dv_spurious,
+		    st.dv_confreads, st.dv_confwrites);
+		stats_printlat(stderr, "intrlat", &st.dv_intrlat);
+		stats_printlat(stderr, "handler", &st.dv_handler);
+		stats_printlat(stderr, "schedwait", &st.dv_schedwait);
+		stats_printlat(stderr, "conf", &st.dv_conflat);
+	}
+}
+
+/*
+ * The statistics, including the DMA memory summary and the MMIO
+ * profile, are dumped to stderr every RUMP_PCI_STATS_INTERVAL seconds
+ * and/or when signal number RUMP_PCI_STATS_SIGNAL arrives.
+ * The signal handler only pokes a pipe, the dumping is done by a
+ * thread of its own.
+ */
+static int statspipe[2] = { -1, -1 };
+static const char *tracefile;
+
+static void
+stats_signal(int sig)
+{
+	int sverrno = errno;
+	ssize_t n;
+
+	/* if the pipe is full, a dump is pending anyway */
+	n = write(statspipe[1], "", 1);
+	(void)n;
+	errno = sverrno;
+}
+
+static void *
+statsthread(void *arg)
+{
+	int timeout = (int)(intptr_t)arg;
+	struct pollfd pfd;
+	char buf[64];
+	ssize_t n;
+
+	pfd.fd = statspipe[0];
+	pfd.events = POLLIN;
+	for (;;) {
+		if ((n = poll(&pfd, 1, timeout)) == -1 && errno != EINTR)
+			break;
+		rumpcomp_pci_stats_dump();
+		rumpcomp_pci_dma_report(0);
+		rumpcomp_pci_mmio_report();
+		if (n <= 0 || (pfd.revents & POLLIN) == 0)
+			continue;
+
+		/* drain the pipe, a single dump covers all signals */
+		while ((n = read(statspipe[0], buf, sizeof(buf))) > 0)
+			continue;
+		if (tracefile && (n = rumpcomp_pci_trace_dump(tracefile)) != 0)
+			warnx("cannot dump trace to %s: %s",
+			    tracefile, strerror(n));
+	}
+	return NULL;
+}
+
+static void
+stats_init(void)
+{
+	struct sigaction sa;
+	sigset_t set, oset;
+	pthread_t pt;
+	const char *env;
+	int interval = 0, sig = 0;
+
+	if ((env = getenv("RUMP_PCI_STATS")) != NULL && atoi(env) == 0)
+		statstiming = 0;
+	if ((env = getenv("RUMP_PCI_STATS_INTERVAL")) != NULL)
+		interval = atoi(env);
+	if ((env = getenv("RUMP_PCI_STATS_SIGNAL")) != NULL)
+		sig = atoi(env);
+	tracefile = getenv("RUMP_PCI_TRACE_FILE");
+	if (interval <= 0 && sig <= 0)
+		return;
+
+	if (pipe2(statspipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+		warn("stats pipe");
+		return;
+	}
+	if (sig > 0) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = stats_signal;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(sig, &sa, NULL) == -1)
+			warn("stats signal %d", sig);
+	}
+
+	/* the signal is for the handler, not for the thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	if (pthread_create(&pt, NULL, statsthread,
+	    (void *)(intptr_t)(interval > 0 ? interval*1000 : -1)) == 0)
+		pthread_detach(pt);
+	else
+		warnx("cannot create stats thread");
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+}
+
+/*
+ * Snapshot the devices currently bound to uio.  We do this only once,
+ * so devices must be bound to uio before the rump kernel boots.
+ */
+static void
+uio_discover(void)
+{
+	struct uiodev *ud, *nud;
+	struct dirent *dent;
+	const char *env;
+	char path[PATH_MAX];
+	DIR *dir;
+	size_t i, nalloc = 0, nbars = 0;
+	int uioidx, residx;
+
+	if ((env = getenv("RUMP_PCI_SYSROOT")) != NULL)
+		sysroot = env;
+	if ((env = getenv("RUMP_PCI_SIM")) != NULL && atoi(env) != 0)
+		pcisim = 1;
+
+	snprintf(path, sizeof(path), "%s/sys/class/uio", sysroot);
+	if ((dir = opendir(path)) == NULL)
+		return;
+	while ((dent = readdir(dir)) != NULL) {
+		if (sscanf(dent->d_name, "uio%d", &uioidx) != 1)
+			continue;
+
+		if (nuiodevs == nalloc) {
+			nalloc = nalloc ? 2*nalloc : 8;
+			nud = realloc(uiodevs, nalloc * sizeof(*uiodevs));
+			if (nud == NULL) {
+				warn("uio device table");
+				break;
+			}
+			uiodevs = nud;
+		}
+		ud = &uiodevs[nuiodevs];
+		memset(ud, 0, sizeof(*ud));
+		ud->uioidx = uioidx;
+		ud->simfd = -1;
+		if (discover_conf(ud) != 0)
+			continue;
+		if (pcisim && (ud->simfd = eventfd(0, EFD_CLOEXEC)) == -1) {
+			warn("uio%d: simulated interrupt", uioidx);
+			close(ud->conf.fd);
+			continue;
+		}
+		discover_addr(ud);
+		discover_bars(ud);
+		discover_irq(ud);
+		discover_numa(ud);
+		discover_cpus(ud);
+		ud->wc = devlisted(ud, getenv("RUMP_PCI_WC"));
+		if (devlisted(ud, getenv("RUMP_PCI_IRQ_POLL"))) {
+			env = getenv("RUMP_PCI_IRQ_POLL_USEC");
+			ud->pollusec = env ? (unsigned)atoi(env) : 50;
+		}
+		nuiodevs++;
+
+		for (residx = 0; residx < PCI_NBARS; residx++) {
+			if (ud->bars[residx].size)
+				nbars++;
+		}
+	}
+	closedir(dir);
+
+	qsort(uiodevs, nuiodevs, sizeof(*uiodevs), devcmp);
+	assign_slots();
+	stats_init();
+
+	if (nbars == 0 || (bartab = calloc(nbars, sizeof(*bartab))) == NULL)
+		return;
+	for (i = 0; i < nuiodevs; i++) {
+		ud = &uiodevs[i];
+		for (residx = 0; residx < PCI_NBARS; residx++) {
+			if (ud->bars[residx].size == 0)
+				continue;
+			bartab[nbartab].base = ud->bars[residx].base;
+			bartab[nbartab].size = ud->bars[residx].size;
+			bartab[nbartab].ud = ud;
+			bartab[nbartab].residx = residx;
+			nbartab++;
+		}
+	}
+	qsort(bartab, nbartab, sizeof(*bartab), barcmp);
+}
+
+static void
+uio_init(void)
+{
+
+	pthread_once(&uioinit_once, uio_discover);
+}
+
+static int
+barlookupcmp(const void *key, const void *elem)
+{
+	unsigned long addr = *(const unsigned long *)key;
+	const struct barent *be = elem;
+
+	if (addr < be->base)
+		return -1;
+	return addr - be->base >= be->size;
+}
+
+static const struct barent *
+barlookup(unsigned long addr)
+{
+
+	uio_init();
+	return bsearch(&addr, bartab, nbartab, sizeof(*bartab), barlookupcmp);
+}
+
+int
+rumpcomp_pci_iospace_init(void)
+{
+
+	uio_init();
+	if (pcisim)
+		return 0;
+
+	assert(selfmapfd == -1);
+	selfmapfd = open("/proc/self/pagemap", O_RDONLY);
+	if (selfmapfd == -1)
+		return 0;
+
+	if (iopl(3) == -1) {
+		int error = rumpuser_component_errtrans(errno);
+
+		close(selfmapfd);
+		return error;
+	}
+
+	return 0;
+}
+
+/*
+ * Prefetchable BARs of devices listed in RUMP_PCI_WC are mapped
+ * write-combining through resourceN_wc, everything else uncached.
+ * The mapping is populated up front so that the driver does not
+ * take page faults on its first register accesses.
+ */
+static void *
+mapbar(struct uiodev *ud, int residx)
+{
+	struct uiobar *bar = &ud->bars[residx];
+	const size_t pagesize = getpagesize();
+	char path[PATH_MAX], file[32];
+	void *mem;
+	int fd = -1;
+
+	if (ud->wc && (bar->flags & IORESOURCE_PREFETCH)) {
+		snprintf(file, sizeof(file), "resource%d_wc", residx);
+		uiopath(path, sizeof(path), ud->uioidx, file);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+	}
+	if (fd == -1) {
+		snprintf(file, sizeof(file), "resource%d", residx);
+		uiopath(path, sizeof(path), ud->uioidx, file);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+	}
+	if (fd == -1)
+		return NULL;
+
+	bar->maplen = (bar->size + pagesize-1) & ~(pagesize-1);
+	mem = mmap(NULL, bar->maplen, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_FILE|MAP_POPULATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	return mem;
+}
+
+static void mmio_protect(struct uiodev *, int);
+static void mmio_unprotect(struct uiodev *, int);
+
+void *
+rumpcomp_pci_map(unsigned long addr, unsigned long len)
+{
+	const struct barent *be;
+	struct uiobar *bar;
+	void *mem = NULL;
+	uint64_t start = trace_start();
+
+	if ((be = barlookup(addr)) == NULL)
+		return NULL;
+	curdev = be->ud;
+	bar = &be->ud->bars[be->residx];
+	if (addr - bar->base + len > bar->size)
+		return NULL;
+
+	pthread_mutex_lock(&genericmtx);
+	if (bar->mem == NULL) {
+		bar->mem = mapbar(be->ud, be->residx);
+		if (bar->mem != NULL)
+			mmio_protect(be->ud, be->residx);
+	}
+	if (bar->mem != NULL) {
+		bar->refs++;
+		mem = (uint8_t *)bar->mem + (addr - bar->base);
+	}
+	pthread_mutex_unlock(&genericmtx);
+	TRACE(map, PCITRACE_MAP, be->ud->uioidx, addr, len, start);
+
+	return mem;
+}
+
+void
+rumpcomp_pci_unmap(void *va, unsigned long len)
+{
+	struct uiobar *bar;
+	size_t i;
+
+	TRACE(unmap, PCITRACE_UNMAP, PCITRACE_NODEV, (uintptr_t)va, len, 0);
+	pthread_mutex_lock(&genericmtx);
+	for (i = 0; i < nbartab; i++) {
+		bar = &bartab[i].ud->bars[bartab[i].residx];
+		if (bar->mem == NULL || (uint8_t *)va < (uint8_t *)bar->mem
+		    || (uint8_t *)va >= (uint8_t *)bar->mem + bar->maplen)
+			continue;
+
+		assert(bar->refs > 0);
+		if (--bar->refs == 0) {
+			mmio_unprotect(bartab[i].ud, bartab[i].residx);
+			munmap(bar->mem, bar->maplen);
+			bar->mem = NULL;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&genericmtx);
+}
+
+/*
+ * MMIO profiler, enabled with RUMP_PCI_MMIO_PROF=1.  BARs are mapped
+ * without access rights, and every access the driver makes traps.
+ * The SIGSEGV handler notes the BAR offset and whether the access is
+ * a read or a write, gives the page access rights and sets the trap
+ * flag.  The access is then executed, and the SIGTRAP raised after
+ * it takes the access rights away again and accounts the time the
+ * access took.  From that we subtract the cost of the trapping itself,
+ * which we measure at startup on ordinary memory, to estimate the time
+ * the CPU stalled on the device.
+ *
+ * This is slow, tens of microseconds per access, so use it to find
+ * hot registers, not to benchmark.  Counts are exact for a single
+ * thread, but accesses which other threads make to a page while it
+ * is being single-stepped are missed.  Page protection is shared by
+ * all threads, so a thread finishing its step may take the rights
+ * away from a page another thread is about to access; that access
+ * faults again, and is counted once, with a longer stall.  Only x86
+ * is supported.
+ */
+#define MMIO_NREGIONS	64		/* BARs we can profile */
+#define MMIO_NSLOTS	4096		/* distinct offsets, power of 2 */
+#define MMIO_NCALIB	63
+#define MMIO_MAXSTEP	4		/* pages touched by one access */
+
+#define X86_EFLAGS_TF	0x100
+
+struct mmioregion {
+	uint8_t *mem;			/* NULL while not mapped */
+	size_t len;
+	struct uiodev *ud;		/* NULL for the calibration page */
+	int residx;
+};
+
+struct mmioslot {
+	uint64_t key;			/* region+1 << 48 | offset */
+	uint64_t reads, writes;
+	uint64_t stallns;
+};
+
+static struct mmioregion mmioregions[MMIO_NREGIONS];
+static struct mmioslot *mmioslots;
+static uint64_t mmiooverflow;
+static uint64_t mmiooverhead;		/* ns per trapped access */
+static uint64_t mmiocalib[MMIO_NCALIB];
+static unsigned mmioncalib;
+static size_t mmiopagesize;
+static int mmioprof;
+static struct sigaction mmiooldsegv, mmiooldtrap;
+static pthread_once_t mmioinit_once = PTHREAD_ONCE_INIT;
+
+/* the access being single-stepped by this thread */
+static __thread struct {
+	uint8_t *pages[MMIO_MAXSTEP];
+	int npages;
+	int region;
+	int write;
+	size_t off;
+	struct timespec start;
+} mmiostep;
+
+static void
+mmio_count(int region, size_t off, int write, uint64_t ns)
+{
+	struct mmioslot *ms;
+	uint64_t key, k;
+	unsigned h, n;
+
+	if (mmioregions[region].ud == NULL) {
+		if (mmioncalib < MMIO_NCALIB)
+			mmiocalib[mmioncalib++] = ns;
+		return;
+	}
+
+	ns = ns > mmiooverhead ? ns - mmiooverhead : 0;
+	key = ((uint64_t)(region+1) << 48) | off;
+	h = (key * 0x9e3779b97f4a7c15ULL) >> 52;
+	for (n = 0; n < MMIO_NSLOTS; n++, h = (h+1) & (MMIO_NSLOTS-1)) {
+		ms = &mmioslots[h];
+		k = __atomic_load_n(&ms->key, __ATOMIC_RELAXED);
+		if (k == 0) {
+			/* claim the slot, unless someone beat us to it */
+			if (!__atomic_compare_exchange_n(&ms->key, &k, key,
+			    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) && k != key)
+				continue;
+		} else if (k != key) {
+			continue;
+		}
+		__atomic_fetch_add(write ? &ms->writes : &ms->reads, 1,
+		    __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ms->stallns, ns, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_fetch_add(&mmiooverflow, 1, __ATOMIC_RELAXED);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Hand a signal which is not ours to whatever was installed before
+ * the profiler.  The profiler stays installed, so the application
+ * handler is called directly.  A default action is carried out by
+ * putting it back and letting the signal happen again: a fault
+ * repeats once we return, a trap has to be raised.
+ */
+static void
+mmio_chain(int sig, siginfo_t *si, void *ctx, struct sigaction *old)
+{
+
+	if (old->sa_flags & SA_SIGINFO) {
+		old->sa_sigaction(sig, si, ctx);
+	} else if (old->sa_handler == SIG_IGN) {
+		if (sig == SIGSEGV)
+			sigaction(sig, old, NULL);
+	} else if (old->sa_handler == SIG_DFL) {
+		sigaction(sig, old, NULL);
+		if (sig != SIGSEGV)
+			raise(sig);
+	} else {
+		old->sa_handler(sig);
+	}
+}
+
+static void
+mmio_segv(int sig, siginfo_t *si, void *ctx)
+{
+	ucontext_t *uc = ctx;
+	struct mmioregion *mr;
+	uint8_t *addr = si->si_addr, *mem, *page;
+	int i, j;
+
+	for (i = 0; i < MMIO_NREGIONS; i++) {
+		mr = &mmioregions[i];
+		mem = __atomic_load_n(&mr->mem, __ATOMIC_ACQUIRE);
+		if (mem && addr >= mem && addr < mem + mr->len)
+			break;
+	}
+	if (i == MMIO_NREGIONS) {
+		mmio_chain(sig, si, ctx, &mmiooldsegv);
+		return;
+	}
+
+	/* another thread protected the page again under us, retry */
+	page = (uint8_t *)((uintptr_t)addr & ~(mmiopagesize-1));
+	for (j = 0; j < mmiostep.npages; j++) {
+		if (mmiostep.pages[j] == page) {
+			mprotect(page, mmiopagesize, PROT_READ|PROT_WRITE);
+			return;
+		}
+	}
+	if (mmiostep.npages == MMIO_MAXSTEP) {
+		mmio_chain(sig, si, ctx, &mmiooldsegv);
+		return;
+	}
+
+	if (mmiostep.npages == 0) {
+		mmiostep.region = i;
+		mmiostep.off = addr - mem;
+		/* bit 1 of the page fault error code is set for writes */
+		mmiostep.write = (uc->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+		clock_gettime(CLOCK_MONOTONIC, &mmiostep.start);
+	}
+	mmiostep.pages[mmiostep.npages++] = page;
+	mprotect(page, mmiopagesize, PROT_READ|PROT_WRITE);
+	uc->uc_mcontext.gregs[REG_EFL] |= X86_EFLAGS_TF;
+}
+
+static void
+mmio_trap(int sig, siginfo_t *si, void *ctx)
+{
+	ucontext_t *uc = ctx;
+	struct timespec now;
+	int i;
+
+	/* only the single step we armed is ours, not breakpoints */
+	if (mmiostep.npages == 0 || si->si_code != TRAP_TRACE) {
+		mmio_chain(sig, si, ctx, &mmiooldtrap);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uc->uc_mcontext.gregs[REG_EFL] &= ~X86_EFLAGS_TF;
+	for (i = 0; i < mmiostep.npages; i++)
+		mprotect(mmiostep.pages[i], mmiopagesize, PROT_NONE);
+	mmiostep.npages = 0;
+
+	mmio_count(mmiostep.region, mmiostep.off, mmiostep.write,
+	    (now.tv_sec - mmiostep.start.tv_sec) * 1000000000ULL
+	    + now.tv_nsec - mmiostep.start.tv_nsec);
+}
+#endif
+
+static int
+mmio_cmpu64(const void *a, const void *b)
+{
+	const uint64_t *ua = a, *ub = b;
+
+	return *ua < *ub ? -1 : *ua > *ub;
+}
+
+static void
+mmio_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct sigaction sa;
+	volatile uint8_t *page;
+	const char *env;
+	int i;
+
+	if ((env = getenv("RUMP_PCI_MMIO_PROF")) == NULL || atoi(env) == 0)
+		return;
+
+	mmiopagesize = getpagesize();
+	if ((mmioslots = calloc(MMIO_NSLOTS, sizeof(*mmioslots))) == NULL)
+		return;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_sigaction = mmio_segv;
+	sigaction(SIGSEGV, &sa, &mmiooldsegv);
+	sa.sa_sigaction = mmio_trap;
+	sigaction(SIGTRAP, &sa, &mmiooldtrap);
+
+	/* measure what trapping an access to ordinary memory costs */
+	page = mmap(NULL, mmiopagesize, PROT_NONE,
+	    MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (page == MAP_FAILED) {
+		warn("mmio profiler calibration");
+		return;
+	}
+	mmioregions[0].len = mmiopagesize;
+	__atomic_store_n(&mmioregions[0].mem, (uint8_t *)page,
+	    __ATOMIC_RELEASE);
+	for (i = 0; i < MMIO_NCALIB; i++)
+		(void)page[0];
+	__atomic_store_n(&mmioregions[0].mem, NULL, __ATOMIC_RELEASE);
+	munmap((void *)page, mmiopagesize);
+	qsort(mmiocalib, mmioncalib, sizeof(mmiocalib[0]), mmio_cmpu64);
+	mmiooverhead = mmioncalib ? mmiocalib[mmioncalib/2] : 0;
+
+	mmioprof = 1;
+#else
+	if (getenv("RUMP_PCI_MMIO_PROF") != NULL)
+		warnx("MMIO profiling not supported on this architecture");
+#endif
+}
+
+/* start profiling a BAR which was just mapped, genericmtx is held */
+static void
+mmio_protect(struct uiodev *ud, int residx)
+{
+	struct uiobar *bar = &ud->bars[residx];
+	struct mmioregion *mr;
+	int i;
+
+	pthread_once(&mmioinit_once, mmio_init);
+	if (!mmioprof)
+		return;
+
+	/*
+	 * Region 0 is for calibration.  A BAR gets the same region
+	 * when it is mapped again, so that its counts stay together.
+	 */
+	for (i = 1; i < MMIO_NREGIONS; i++) {
+		mr = &mmioregions[i];
+		if (mr->ud == ud && mr->residx == residx)
+			break;
+	}
+	if (i == MMIO_NREGIONS) {
+		for (i = 1; i < MMIO_NREGIONS; i++) {
+			if (mmioregions[i].ud == NULL)
+				break;
+		}
+	}
+	if (i == MMIO_NREGIONS) {
+		warnx("too many BARs to profile, uio%d BAR %d is not",
+		    ud->uioidx, residx);
+		return;
+	}
+
+	mr = &mmioregions[i];
+	mr->ud = ud;
+	mr->residx = residx;
+	mr->len = bar->maplen;
+	__atomic_store_n(&mr->mem, (uint8_t *)bar->mem, __ATOMIC_RELEASE);
+	if (mprotect(bar->mem, bar->maplen, PROT_NONE) == -1)
+		warn("cannot profile uio%d BAR %d", ud->uioidx, residx);
+}
+
+/* a BAR is about to be unmapped, genericmtx is held */
+static void
+mmio_unprotect(struct uiodev *ud, int residx)
+{
+	int i;
+
+	if (!mmioprof)
+		return;
+	for (i = 1; i < MMIO_NREGIONS; i++) {
+		if (mmioregions[i].ud == ud && mmioregions[i].residx == residx)
+			__atomic_store_n(&mmioregions[i].mem, NULL,
+			    __ATOMIC_RELEASE);
+	}
+}
+
+static int
+mmio_cmpslot(const void *a, const void *b)
+{
+	const struct mmioslot *sa = a, *sb = b;
+
+	/* hottest first */
+	if (sa->stallns != sb->stallns)
+		return sa->stallns < sb->stallns ? 1 : -1;
+	if (sa->reads + sa->writes != sb->reads + sb->writes)
+		return sa->reads + sa->writes < sb->reads + sb->writes
+		    ? 1 : -1;
+	return 0;
+}
+
+void
+rumpcomp_pci_mmio_report(void)
+{
+	struct mmioslot *sl, *ms;
+	struct mmioregion *mr;
+	uint64_t n, off;
+	size_t i, nsl;
+
+	if (!mmioprof)
+		return;
+	if ((sl = malloc(MMIO_NSLOTS * sizeof(*sl))) == NULL)
+		return;
+	for (i = nsl = 0; i < MMIO_NSLOTS; i++) {
+		if (__atomic_load_n(&mmioslots[i].key, __ATOMIC_RELAXED))
+			sl[nsl++] = mmioslots[i];
+	}
+	qsort(sl, nsl, sizeof(*sl), mmio_cmpslot);
+
+	fprintf(stderr, "mmio: trap overhead %" PRIu64 " ns, "
+	    "%" PRIu64 " accesses not recorded\n", mmiooverhead,
+	    __atomic_load_n(&mmiooverflow, __ATOMIC_RELAXED));
+	for (i = 0; i < nsl; i++) {
+		ms = &sl[i];
+		mr = &mmioregions[(ms->key >> 48) - 1];
+		n = ms->reads + ms->writes;
+		off = ms->key & (((uint64_t)1 << 48) - 1);
+		fprintf(stderr, "mmio: uio%d BAR %d +0x%06" PRIx64 ": "
+		    "reads %" PRIu64 " writes %" PRIu64 " stall %" PRIu64
+		    " ns (%" PRIu64 " ns/access)\n",
+		    mr->ud->uioidx, mr->residx, off,
+		    ms->reads, ms->writes, ms->stallns,
+		    n ? ms->stallns / n : 0);
+	}
+	free(sl);
+}
+
+/*
+ * Optional io_uring engine, enabled with RUMP_PCI_IOURING=1.  It is
+ * used to submit the writes of rumpcomp_pci_confwrite_vec() with
+ * one syscall, and by the interrupt dispatchers (see below) to wait
+ * for all their interrupts and unmask them again with one syscall per
+ * round instead of an epoll_wait, a read and a write per interrupt.
+ * If the kernel does not let us set up a ring, we silently go on
+ * using the plain syscalls.
+ *
+ * This is just enough io_uring for the above, talking to the kernel
+ * directly instead of depending on liburing.  A ring must be used by
+ * one thread at a time.
+ */
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sqlocal;		/* tail, published when entering */
+	unsigned tosubmit;
+
+	void *sqring, *cqring;		/* for uring_fini() */
+	size_t sqlen, cqlen, sqeslen;
+};
+
+static int
+uring_enabled(void)
+{
+	const char *env;
+
+	env = getenv("RUMP_PCI_IOURING");
+	return env != NULL && atoi(env) != 0;
+}
+
+static int
+uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	size_t sqlen, cqlen, sqeslen;
+	uint8_t *sq, *cq = MAP_FAILED;
+	void *sqes = MAP_FAILED;
+
+	memset(&p, 0, sizeof(p));
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1)
+		return errno;
+
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sqlen = cqlen = sqlen > cqlen ? sqlen : cqlen;
+
+	sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	    r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else
+		cq = mmap(NULL, cqlen, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+		goto fail;
+	sqes = mmap(NULL, sqeslen, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto fail;
+
+	r->entries = p.sq_entries;
+	r->sqhead = (unsigned *)(sq + p.sq_off.head);
+	r->sqtail = (unsigned *)(sq + p.sq_off.tail);
+	r->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sqarray = (unsigned *)(sq + p.sq_off.array);
+	r->cqhead = (unsigned *)(cq + p.cq_off.head);
+	r->cqtail = (unsigned *)(cq + p.cq_off.tail);
+	r->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->sqes = sqes;
+	r->sqlocal = *r->sqtail;
+	r->tosubmit = 0;
+	r->sqring = sq;
+	r->cqring = cq;
+	r->sqlen = sqlen;
+	r->cqlen = cqlen;
+	r->sqeslen = sqeslen;
+	return 0;
+
+ fail:
+	if (cq != MAP_FAILED && cq != sq)
+		munmap(cq, cqlen);
+	if (sq != MAP_FAILED)
+		munmap(sq, sqlen);
+	close(r->fd);
+	r->fd = -1;
+	return ENOMEM;
+}
+
+static void
+uring_fini(struct uring *r)
+{
+
+	munmap(r->sqes, r->sqeslen);
+	if (r->cqring != r->sqring)
+		munmap(r->cqring, r->cqlen);
+	munmap(r->sqring, r->sqlen);
+	close(r->fd);
+	r->fd = -1;
+}
+
+/* submit what is queued and wait for at least wait completions */
+static int
+uring_enter(struct uring *r, unsigned wait)
+{
+	int n;
+
+	__atomic_store_n(r->sqtail, r->sqlocal, __ATOMIC_RELEASE);
+	do {
+		n = syscall(__NR_io_uring_enter, r->fd, r->tosubmit, wait,
+		    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		r->tosubmit -= n;
+	} while (r->tosubmit > 0);
+	return 0;
+}
+
+/* queue a read or write, flushing the queue if it is full */
+static struct io_uring_sqe *
+uring_rw(struct uring *r, int op, int fd, void *buf, size_t len,
+	uint64_t off, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	while (r->sqlocal - __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE)
+	    >= r->entries)
+		uring_enter(r, 0);
+
+	idx = r->sqlocal & *r->sqmask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = data;
+	r->sqarray[idx] = idx;
+	r->sqlocal++;
+	r->tosubmit++;
+	return sqe;
+}
+
+/* get the next completion, or NULL; the caller must copy it out */
+static struct io_uring_cqe *
+uring_cqe(struct uring *r)
+{
+	unsigned head = *r->cqhead;
+
+	if (head == __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & *r->cqmask];
+}
+
+static void
+uring_cqdone(struct uring *r)
+{
+
+	__atomic_store_n(r->cqhead, *r->cqhead + 1, __ATOMIC_RELEASE);
+}
+
+static struct uring confring = { .fd = -1 };
+static pthread_mutex_t confringmtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t confring_once = PTHREAD_ONCE_INIT;
+
+static void
+confring_init(void)
+{
+
+	if (uring_enabled() && uring_init(&confring, PCI_CONF_NREGS) != 0
+	    && getenv("RUMP_VERBOSE"))
+		printf("io_uring not available for config space access\n");
+}
+
+static struct uiodev *
+getdev(unsigned bus, unsigned dev, unsigned fun)
+{
+
+	uio_init();
+	if (bus != 0 || dev >= PCI_MAXDEVS || fun >= PCI_MAXFUNCS)
+		return NULL;
+	if (pcislots[dev][fun] != NULL)
+		curdev = pcislots[dev][fun];
+	return pcislots[dev][fun];
+}
+
+static int
+confshadowable(struct uioconf *uc, int reg)
+{
+
+	return reg >= 0 && reg < PCI_CONF_NREGS*4 && (reg & 3) == 0
+	    && (uc->shadowmap & CONFREG(reg)) != 0;
+}
+
+static void __attribute__((destructor))
+closeconfs(void)
+{
+	size_t i;
+
+	pthread_mutex_lock(&genericmtx);
+	for (i = 0; i < nuiodevs; i++) {
+		if (uiodevs[i].conf.fd != -1) {
+			close(uiodevs[i].conf.fd);
+			uiodevs[i].conf.fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&genericmtx);
+}
+
+int
+rumpcomp_pci_confread_range(unsigned bus, unsigned dev, unsigned fun,
+	int reg, unsigned int *rv, size_t nregs)
+{
+	struct uiodev *ud;
+	struct uioconf *uc;
+	uint64_t want = 0, t, start;
+	unsigned gen = 0;
+	size_t i, nshadow = 0;
+	ssize_t len = nregs * sizeof(*rv), n;
+
+	for (i = 0; i < nregs; i++)
+		rv[i] = 0xffffffff;
+
+	if ((ud = getdev(bus, dev, fun)) == NULL)
+		return 1;
+	uc = &ud->conf;
+	__atomic_fetch_add(&ud->stats.nconfreads, nregs, __ATOMIC_RELAXED);
+	start = trace_start();
+
+	/* if everything we want is shadowed, we don't need to go out */
+	for (i = 0; i < nregs && reg + 4*i < PCI_CONF_NREGS*4; i++) {
+		if (confshadowable(uc, reg + 4*i)) {
+			want |= CONFREG(reg + 4*i);
+			nshadow++;
+		}
+	}
+	if (want) {
+		pthread_mutex_lock(&genericmtx);
+		if (nshadow == nregs && (uc->shadowvalid & want) == want) {
+			for (i = 0; i < nregs; i++)
+				rv[i] = uc->shadow[reg/4 + i];
+			pthread_mutex_unlock(&genericmtx);
+			TRACE(confread, PCITRACE_CONFREAD, ud->uioidx,
+			    reg, nregs, start);
+			return 0;
+		}
+		gen = uc->gen;
+		pthread_mutex_unlock(&genericmtx);
+	}
+
+	t = stats_now();
+	n = pread(uc->fd, rv, len, reg);
+	hist_add(&ud->stats.conflat, stats_now() - t);
+	TRACE(confread, PCITRACE_CONFREAD, ud->uioidx, reg, nregs, start);
+	if (n != len) {
+		warn("uio%d config space read", ud->uioidx);
+		return 0;
+	}
+
+	/* don't cache the values if someone wrote to config space meanwhile */
+	if (want) {
+		pthread_mutex_lock(&genericmtx);
+		if (uc->gen == gen) {
+			for (i = 0; i < nregs
+			    && reg + 4*i < PCI_CONF_NREGS*4; i++) {
+				if (confshadowable(uc, reg + 4*i))
+					uc->shadow[reg/4 + i] = rv[i];
+			}
+			uc->shadowvalid |= want;
+		}
+		pthread_mutex_unlock(&genericmtx);
+	}
+
+	return 0;
+}
+
+/*
+ * Write up to PCI_CONF_NREGS ops through the io_uring, in order.
+ * Each run of consecutive registers is one linked write, so that
+ * a failed write cancels the ones after it.
+ */
+static void
+confwrite_uring(struct uiodev *ud, const struct rumpcomp_pci_confop *ops,
+	size_t nops)
+{
+	unsigned int vals[PCI_CONF_NREGS];
+	struct io_uring_sqe *sqe = NULL;
+	struct io_uring_cqe *cqe;
+	size_t i, n, nruns = 0;
+	int failed = 0;
+
+	for (i = 0; i < nops; i++)
+		vals[i] = ops[i].val;
+
+	pthread_mutex_lock(&confringmtx);
+	for (i = 0; i < nops; i += n) {
+		for (n = 1; i+n < nops; n++) {
+			if (ops[i+n].reg != ops[i].reg + 4*(int)n)
+				break;
+		}
+		if (sqe)
+			sqe->flags |= IOSQE_IO_LINK;
+		sqe = uring_rw(&confring, IORING_OP_WRITE, ud->conf.fd,
+		    &vals[i], n*4, ops[i].reg, 0);
+		nruns++;
+	}
+	if (uring_enter(&confring, nruns) == -1)
+		warn("io_uring_enter");
+	while (nruns > 0) {
+		if ((cqe = uring_cqe(&confring)) == NULL) {
+			uring_enter(&confring, 1);
+			continue;
+		}
+		if (cqe->res < 0 || (size_t)cqe->res % 4 != 0)
+			failed = 1;
+		uring_cqdone(&confring);
+		nruns--;
+	}
+	pthread_mutex_unlock(&confringmtx);
+
+	if (failed)
+		warnx("uio%d config space write failed", ud->uioidx);
+}
+
+/*
+ * What a register of a simulated device reads as after val is written
+ * to it: IDs and class are read-only, BARs hardwire the bits below
+ * their size so that sizing them works, status bits are cleared by
+ * writing 1, and the interrupt pin is read-only.
+ */
+static uint32_t
+sim_confval(const struct uiodev *ud, int reg, uint32_t old, uint32_t val)
+{
+	const struct uiobar *bar;
+	int residx;
+
+	switch (reg) {
+	case 0x00: case 0x08: case 0x2c:
+		return old;
+	case 0x04:
+		return (val & 0xffff) | (old & ~val & 0xffff0000);
+	case 0x30:
+		return 0;			/* no expansion ROM */
+	case 0x3c:
+		return (old & ~0xffU) | (val & 0xff);
+	}
+	if (reg < 0x10 || reg >= 0x10 + 4*PCI_NBARS)
+		return val;
+
+	residx = (reg - 0x10) / 4;
+	bar = &ud->bars[residx];
+	if (bar->size == 0 && residx > 0
+	    && (ud->bars[residx-1].flags & IORESOURCE_MEM_64)) {
+		/* upper half of a 64bit BAR */
+		return val & ~(uint32_t)((ud->bars[residx-1].size - 1) >> 32);
+	}
+	if (bar->size == 0)
+		return 0;
+	return (val & ~(uint32_t)(bar->size - 1))
+	    | (old & ((bar->flags & IORESOURCE_IO) ? 0x3 : 0xf));
+}
+
+/* write config space of a simulated device, returns ops done */
+static size_t
+sim_confwrite(struct uiodev *ud, const struct rumpcomp_pci_confop *ops,
+	size_t nops)
+{
+	uint32_t old, val;
+	size_t i;
+
+	for (i = 0; i < nops; i++) {
+		if (pread(ud->conf.fd, &old, sizeof(old), ops[i].reg)
+		    != sizeof(old))
+			old = 0;
+		val = sim_confval(ud, ops[i].reg, old, ops[i].val);
+		if (pwrite(ud->conf.fd, &val, sizeof(val), ops[i].reg)
+		    != sizeof(val))
+			warn("uio%d config space write", ud->uioidx);
+	}
+	return nops;
+}
+
+/*
+ * Consecutive registers are written with a single pwrite, or if
+ * the io_uring engine is enabled, all runs with a single syscall.
+ */
+int
+rumpcomp_pci_confwrite_vec(unsigned bus, unsigned dev, unsigned fun,
+	const struct rumpcomp_pci_confop *ops, size_t nops)
+{
+	unsigned int vals[PCI_CONF_NREGS];
+	struct uiodev *ud;
+	struct uioconf *uc;
+	uint64_t inval = 0, t, start;
+	size_t i, n;
+
+	if ((ud = getdev(bus, dev, fun)) == NULL)
+		return 1;
+	uc = &ud->conf;
+	__atomic_fetch_add(&ud->stats.nconfwrites, nops, __ATOMIC_RELAXED);
+
+	start = trace_start();
+	t = stats_now();
+	pthread_once(&confring_once, confring_init);
+	i = 0;
+	if (ud->simfd != -1)
+		i = sim_confwrite(ud, ops, nops);
+	for (; i < nops && nops > 1 && confring.fd != -1; i += n) {
+		n = nops - i < PCI_CONF_NREGS ? nops - i : PCI_CONF_NREGS;
+		confwrite_uring(ud, &ops[i], n);
+	}
+	for (; i < nops; i += n) {
+		vals[0] = ops[i].val;
+		for (n = 1; i+n < nops && n < PCI_CONF_NREGS; n++) {
+			if (ops[i+n].reg != ops[i].reg + 4*(int)n)
+				break;
+			vals[n] = ops[i+n].val;
+		}
+		if (pwrite(uc->fd, vals, n*4, ops[i].reg) != (ssize_t)n*4)
+			warn("uio%d config space write", ud->uioidx);
+	}
+	hist_add(&ud->stats.conflat, stats_now() - t);
+	TRACE(confwrite, PCITRACE_CONFWRITE, ud->uioidx,
+	    nops ? ops[0].reg : 0, nops, start);
+
+	for (i = 0; i < nops; i++) {
+		if (confshadowable(uc, ops[i].reg))
+			inval |= CONFREG(ops[i].reg);
+	}
+	if (inval) {
+		pthread_mutex_lock(&genericmtx);
+		uc->shadowvalid &= ~inval;
+		uc->gen++;
+		pthread_mutex_unlock(&genericmtx);
+	}
+
+	return 0;
+}
+
+int
+rumpcomp_pci_confread(unsigned bus, unsigned dev, unsigned fun,
+	int reg, unsigned int *rv)
+{
+
+	return rumpcomp_pci_confread_range(bus, dev, fun, reg, rv, 1);
+}
+
+int
+rumpcomp_pci_confwrite(unsigned bus, unsigned dev, unsigned fun,
+	int reg, unsigned int v)
+{
+	struct rumpcomp_pci_confop op = { .reg = reg, .val = v };
+
+	return rumpcomp_pci_confwrite_vec(bus, dev, fun, &op, 1);
+}
+
+/*
+ * Interrupt threads are pinned to a CPU close to the device, or
+ * to one of the CPUs listed in RUMP_PCI_IRQ_CPUS.  Interrupts are
+ * spread over the candidate CPUs round-robin.  If RUMP_PCI_IRQ_PRIO
+ * is set, the threads run SCHED_FIFO at that priority.
+ *
+ * Devices can also be put into busy-poll mode, either by listing them
+ * in RUMP_PCI_IRQ_POLL or at runtime with rumpcomp_pci_irq_setpoll().
+ * In that mode, after an interrupt the thread leaves the interrupt
+ * masked and keeps calling the handler until it has found nothing to
+ * do for the configured time (RUMP_PCI_IRQ_POLL_USEC, default 50us),
+ * and only then unmasks the interrupt and goes back to sleep.  This
+ * saves the wakeup for packets arriving close to each other.
+ *
+ * Normally each interrupt gets a thread of its own.  With many devices,
+ * RUMP_PCI_IRQ_DISPATCH=N instead makes N dispatcher threads wait for
+ * the interrupts with epoll, each interrupt being assigned to one of
+ * them round-robin.  When several of a dispatcher's interrupts are
+ * ready at once, their handlers run under a single schedule.  Note
+ * that a device in busy-poll mode holds up the other interrupts of its
+ * dispatcher while it is polled.
+ *
+ * With RUMP_PCI_IOURING=1 the dispatchers (one unless configured
+ * otherwise) use an io_uring instead of epoll: a read is kept pending
+ * on every /dev/uioN, and after the handlers have run, the unmask
+ * writes and the new reads are submitted in the same io_uring_enter()
+ * that waits for the next completions.
+ */
+#define INTR_STACKSIZE	(128*1024)
+#define DISP_MAXEVENTS	32
+
+#define PCI_COMMAND		0x04
+#define PCI_COMMAND_INT_DISABLE	0x400
+
+/* this is a multifunction data structure! */
+struct irq {
+	unsigned magic_cookie;
+	struct uiodev *ud;
+
+	int (*handler)(void *);
+	void *data;
+	int fd;
+	int cpu;
+	int useconf;
+	size_t rsize;			/* bytes to read per interrupt */
+	uint64_t rbuf;			/* io_uring read buffer */
+
+	LIST_ENTRY(irq) entries;
+	LIST_ENTRY(irq) newentries;	/* see irqdisp */
+};
+static LIST_HEAD(, irq) irqs = LIST_HEAD_INITIALIZER(&irqs);
+
+struct irqdisp {
+	int epfd;			/* -1 until the thread is started */
+	int cpu;
+
+	/*
+	 * With io_uring, only the dispatcher thread may touch the
+	 * ring, so new interrupts are put on a list protected by
+	 * genericmtx, and the dispatcher is woken up with evfd.
+	 */
+	struct uring *ring;
+	int evfd;
+	uint64_t evbuf;
+	LIST_HEAD(, irq) newirqs;
+};
+static struct irqdisp *irqdisps;
+static int nirqdisps;			/* 0 for a thread per interrupt */
+static unsigned nextdisp;
+static pthread_once_t dispinit_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Re-enable the interrupt after it fired.  uio drivers which support
+ * it (e.g. uio_pci_generic) do that when we write 1 to the device,
+ * which is much cheaper than going through config space.  For the
+ * others, we clear the interrupt disable bit in the command register.
+ */
+static int
+intr_enable(struct irq *irq, int useconf)
+{
+	const unsigned device = irq->ud->vdev, fun = irq->ud->vfun;
+	const uint32_t one = 1;
+	unsigned int val;
+
+	if (!useconf)
+		return write(irq->fd, &one, sizeof(one)) == sizeof(one);
+
+	rumpcomp_pci_confread(0, device, fun, PCI_COMMAND, &val);
+	if (val & PCI_COMMAND_INT_DISABLE) {
+		//printf("interrupt disabled!\n");
+		val &= ~PCI_COMMAND_INT_DISABLE;
+		rumpcomp_pci_confwrite(0, device, fun, PCI_COMMAND, val);
+	}
+	return 1;
+}
+
+static void
+intr_start(struct irq *irq)
+{
+
+	/* writing to a simulated interrupt would fire it */
+	irq->useconf = irq->ud->simfd != -1;
+	if (!intr_enable(irq, irq->useconf)) {
+		irq->useconf = 1;
+		intr_enable(irq, irq->useconf);
+	}
+}
+
+/*
+ * Run the handler.  woke is when we learned about the interrupt,
+ * or 0 when polling.
+ */
+static int
+intr_run(struct irq *irq, uint64_t woke)
+{
+	struct uiostats *st = &irq->ud->stats;
+	uint64_t t0, t1, t2, t3, start;
+	int rv;
+
+	t0 = stats_now();
+	rumpuser_component_schedule(NULL);
+	t1 = stats_now();
+	start = trace_start();
+	rv = irq->handler(irq->data);
+	TRACE(handler, PCITRACE_HANDLER, irq->ud->uioidx, 0, rv, start);
+	t2 = stats_now();
+	rumpuser_component_unschedule();
+	t3 = stats_now();
+
+	if (woke)
+		hist_add(&st->intrlat, t1 - woke);
+	hist_add(&st->handler, t2 - t1);
+	hist_add(&st->schedwait, (t1 - t0) + (t3 - t2));
+	return rv;
+}
+
+/* a wakeup without an interrupt */
+static void
+intr_spurious(struct irq *irq)
+{
+
+	__atomic_fetch_add(&irq->ud->stats.nspurious, 1, __ATOMIC_RELAXED);
+	if (getenv("RUMP_VERBOSE"))
+		printf("NOT AN INTERRUPT!\n");
+}
+
+static void
+intr_poll(struct irq *irq, unsigned usec)
+{
+	struct uiodev *ud = irq->ud;
+	struct timespec now, busy;
+
+	clock_gettime(CLOCK_MONOTONIC, &busy);
+	for (;;) {
+		__atomic_fetch_add(&ud->npolls, 1, __ATOMIC_RELAXED);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (intr_run(irq, 0)) {
+			__atomic_fetch_add(&ud->npollhits, 1, __ATOMIC_RELAXED);
+			busy = now;
+			continue;
+		}
+
+		if ((now.tv_sec - busy.tv_sec) * 1000000
+		    + (now.tv_nsec - busy.tv_nsec) / 1000 >= usec)
+			break;
+	}
+}
+
+static void *
+intrthread(void *arg)
+{
+	struct irq *irq = arg;
+	struct uiodev *ud = irq->ud;
+	uint64_t val = 0;
+	unsigned usec;
+	int ret;
+
+	rumpuser_component_kthread();
+	intr_start(irq);
+	for (;;) {
+		ret = read(irq->fd, &val, irq->rsize);
+		if (ret == -1) {
+			warn("read from UIO device %d", irq->ud->uioidx);
+		} else if (ret > 0) {
+			//printf("INTERRUPT!\n");
+			__atomic_fetch_add(&ud->nwakeups, 1, __ATOMIC_RELAXED);
+			TRACE(intr, PCITRACE_INTR, ud->uioidx, val, 0, 0);
+			if (!intr_run(irq, stats_now()))
+				__atomic_fetch_add(&ud->stats.nspurious, 1,
+				    __ATOMIC_RELAXED);
+			usec = __atomic_load_n(&ud->pollusec, __ATOMIC_RELAXED);
+			if (usec)
+				intr_poll(irq, usec);
+		} else {
+			intr_spurious(irq);
+		}
+		intr_enable(irq, irq->useconf);
+	}
+	return NULL;
+}
+
+/*
+ * Run the handlers of the ready interrupts under one schedule.
+ * The time spent in schedule and unschedule is accounted to each
+ * of the devices.
+ */
+static void
+disp_run(struct irq **ready, uint64_t *woke, int nready)
+{
+	struct uiostats *st;
+	uint64_t t0, t1, t2, h0, h1, wait, start;
+	unsigned usec;
+	int i, rv;
+
+	if (nready == 0)
+		return;
+
+	t0 = stats_now();
+	rumpuser_component_schedule(NULL);
+	h0 = t1 = stats_now();
+	for (i = 0; i < nready; i++) {
+		st = &ready[i]->ud->stats;
+		hist_add(&st->intrlat, h0 - woke[i]);
+		start = trace_start();
+		rv = ready[i]->handler(ready[i]->data);
+		TRACE(handler, PCITRACE_HANDLER, ready[i]->ud->uioidx,
+		    0, rv, start);
+		if (!rv)
+			__atomic_fetch_add(&st->nspurious, 1,
+			    __ATOMIC_RELAXED);
+		h1 = stats_now();
+		hist_add(&st->handler, h1 - h0);
+		h0 = h1;
+	}
+	t2 = h0;
+	rumpuser_component_unschedule();
+	wait = (t1 - t0) + (stats_now() - t2);
+	for (i = 0; i < nready; i++)
+		hist_add(&ready[i]->ud->stats.schedwait, wait);
+
+	for (i = 0; i < nready; i++) {
+		usec = __atomic_load_n(&ready[i]->ud->pollusec,
+		    __ATOMIC_RELAXED);
+		if (usec)
+			intr_poll(ready[i], usec);
+	}
+}
+
+static void *
+dispthread(void *arg)
+{
+	struct irqdisp *d = arg;
+	struct epoll_event ev[DISP_MAXEVENTS];
+	struct irq *ready[DISP_MAXEVENTS];
+	uint64_t woke[DISP_MAXEVENTS];
+	struct irq *irq;
+	uint64_t val = 0;
+	int i, n, nready, ret;
+
+	rumpuser_component_kthread();
+	for (;;) {
+		n = epoll_wait(d->epfd, ev, DISP_MAXEVENTS, -1);
+		if (n == -1) {
+			if (errno != EINTR)
+				warn("epoll_wait");
+			continue;
+		}
+
+		for (i = nready = 0; i < n; i++) {
+			irq = ev[i].data.ptr;
+			ret = read(irq->fd, &val, irq->rsize);
+			if (ret == -1) {
+				warn("read from UIO device %d",
+				    irq->ud->uioidx);
+			} else if (ret > 0) {
+				__atomic_fetch_add(&irq->ud->nwakeups, 1,
+				    __ATOMIC_RELAXED);
+				TRACE(intr, PCITRACE_INTR, irq->ud->uioidx,
+				    val, 0, 0);
+				woke[nready] = stats_now();
+				ready[nready++] = irq;
+			} else {
+				intr_spurious(irq);
+			}
+		}
+
+		disp_run(ready, woke, nready);
+		for (i = 0; i < n; i++) {
+			irq = ev[i].data.ptr;
+			intr_enable(irq, irq->useconf);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * user_data of the io_uring requests: the irq for reads from the
+ * device, with the low bit set for the unmask writes, and 0 for the
+ * read from the wakeup eventfd.
+ */
+#define UDATA_WAKE	0
+#define UDATA_WRITE	1
+
+static const uint32_t intr_one = 1;
+
+/* unmask (if asked to) and queue the read for the next interrupt */
+static void
+disp_arm(struct irqdisp *d, struct irq *irq, int unmask)
+{
+
+	if (unmask && irq->useconf)
+		intr_enable(irq, irq->useconf);
+	else if (unmask)
+		uring_rw(d->ring, IORING_OP_WRITE, irq->fd, (void *)&intr_one,
+		    sizeof(intr_one), (uint64_t)-1,
+		    (uintptr_t)irq | UDATA_WRITE);
+	uring_rw(d->ring, IORING_OP_READ, irq->fd, &irq->rbuf,
+	    irq->rsize, (uint64_t)-1, (uintptr_t)irq);
+}
+
+static void
+disp_newirqs(struct irqdisp *d)
+{
+	struct irq *irq;
+
+	for (;;) {
+		pthread_mutex_lock(&genericmtx);
+		if ((irq = LIST_FIRST(&d->newirqs)) != NULL)
+			LIST_REMOVE(irq, newentries);
+		pthread_mutex_unlock(&genericmtx);
+		if (irq == NULL)
+			break;
+
+		/* may go through config space, so not under the lock */
+		intr_start(irq);
+		disp_arm(d, irq, 0);
+	}
+
+	uring_rw(d->ring, IORING_OP_READ, d->evfd, &d->evbuf,
+	    sizeof(d->evbuf), (uint64_t)-1, UDATA_WAKE);
+}
+
+static void *
+dispthread_uring(void *arg)
+{
+	struct irqdisp *d = arg;
+	struct irq *done[DISP_MAXEVENTS], *ready[DISP_MAXEVENTS];
+	uint64_t woke[DISP_MAXEVENTS];
+	struct io_uring_cqe *cqe;
+	struct irq *irq;
+	uint64_t data;
+	int i, ndone, nready, res;
+
+	rumpuser_component_kthread();
+	disp_newirqs(d);
+	for (;;) {
+		if (uring_enter(d->ring, 1) == -1) {
+			warn("io_uring_enter");
+			continue;
+		}
+
+		ndone = nready = 0;
+		while (ndone < DISP_MAXEVENTS
+		    && (cqe = uring_cqe(d->ring)) != NULL) {
+			data = cqe->user_data;
+			res = cqe->res;
+			uring_cqdone(d->ring);
+
+			if (data == UDATA_WAKE) {
+				disp_newirqs(d);
+				continue;
+			}
+			irq = (struct irq *)(uintptr_t)(data & ~UDATA_WRITE);
+			if (data & UDATA_WRITE) {
+				if (res < 0)
+					intr_enable(irq, irq->useconf);
+				continue;
+			}
+
+			if (res < 0) {
+				errno = -res;
+				warn("read from UIO device %d",
+				    irq->ud->uioidx);
+			} else if (res > 0) {
+				__atomic_fetch_add(&irq->ud->nwakeups, 1,
+				    __ATOMIC_RELAXED);
+				TRACE(intr, PCITRACE_INTR, irq->ud->uioidx,
+				    irq->rbuf, 0, 0);
+				woke[nready] = stats_now();
+				ready[nready++] = irq;
+			} else {
+				intr_spurious(irq);
+			}
+			done[ndone++] = irq;
+		}
+
+		disp_run(ready, woke, nready);
+		for (i = 0; i < ndone; i++)
+			disp_arm(d, done[i], 1);
+	}
+	return NULL;
+}
+
+int
+rumpcomp_pci_irq_map(unsigned bus, unsigned device, unsigned fun,
+	int intrline, unsigned cookie)
+{
+	struct uiodev *ud;
+	struct irq *irq;
+
+	if ((ud = getdev(bus, device, fun)) == NULL)
+		return ENOENT;
+
+	irq = malloc(sizeof(*irq));
+	if (irq == NULL)
+		return ENOENT;
+
+	irq->magic_cookie = cookie;
+	irq->ud = ud;
+
+	pthread_mutex_lock(&genericmtx);
+	LIST_INSERT_HEAD(&irqs, irq, entries);
+	pthread_mutex_unlock(&genericmtx);
+
+	return 0;
+}
+
+static int
+intr_pickcpu(struct uiodev *ud)
+{
+	static unsigned nextcpu;
+	const char *env;
+	cpu_set_t set, allowed;
+	unsigned n;
+	int cpu, ncpus;
+
+	if ((env = getenv("RUMP_PCI_IRQ_CPUS")) != NULL) {
+		if (parsecpus(env, &set) != 0) {
+			warnx("invalid RUMP_PCI_IRQ_CPUS \"%s\"", env);
+			return -1;
+		}
+	} else {
+		set = ud->localcpus;
+	}
+	/* don't pick CPUs we are not allowed to run on */
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+		CPU_AND(&set, &set, &allowed);
+	if ((ncpus = CPU_COUNT(&set)) == 0)
+		return -1;
+
+	pthread_mutex_lock(&genericmtx);
+	n = nextcpu++ % ncpus;
+	pthread_mutex_unlock(&genericmtx);
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set) && n-- == 0)
+			break;
+	}
+	return cpu;
+}
+
+static int
+intr_create(void *(*func)(void *), void *arg, int cpu, int rt)
+{
+	struct sched_param sp;
+	pthread_attr_t attr;
+	pthread_t pt;
+	cpu_set_t set;
+	const char *env;
+	int error;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, INTR_STACKSIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (cpu != -1) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+	if (rt && (env = getenv("RUMP_PCI_IRQ_PRIO")) != NULL) {
+		sp.sched_priority = atoi(env);
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &sp);
+	}
+
+	error = pthread_create(&pt, &attr, func, arg);
+	pthread_attr_destroy(&attr);
+	if (error == EPERM && rt) {
+		warnx("no permission for realtime interrupt thread");
+		error = intr_create(func, arg, cpu, 0);
+	}
+	return error;
+}
+
+static void
+dispatch_init(void)
+{
+	const char *env;
+	int i, n;
+
+	if ((env = getenv("RUMP_PCI_IRQ_DISPATCH")) != NULL)
+		n = atoi(env);
+	else
+		n = uring_enabled() ? 1 : 0;
+	if (n <= 0)
+		return;
+	if ((irqdisps = calloc(n, sizeof(*irqdisps))) == NULL) {
+		warn("interrupt dispatchers");
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		irqdisps[i].epfd = -1;
+		LIST_INIT(&irqdisps[i].newirqs);
+	}
+	nirqdisps = n;
+}
+
+/* start a dispatcher using io_uring, called with genericmtx held */
+static int
+dispatch_start_uring(struct irqdisp *d)
+{
+	struct uring *r;
+	int error;
+
+	/* room for an unmask and a read per interrupt */
+	if ((r = malloc(sizeof(*r))) == NULL)
+		return ENOMEM;
+	if ((error = uring_init(r, 2*DISP_MAXEVENTS)) != 0) {
+		free(r);
+		return error;
+	}
+	if ((d->evfd = eventfd(0, EFD_CLOEXEC)) == -1) {
+		error = errno;
+		goto fail;
+	}
+	d->ring = r;
+	if ((error = intr_create(dispthread_uring, d, d->cpu, 1)) != 0) {
+		close(d->evfd);
+		d->ring = NULL;
+		goto fail;
+	}
+	return 0;
+
+ fail:
+	uring_fini(r);
+	free(r);
+	return error;
+}
+
+/*
+ * Hand the interrupt over to a dispatcher, starting the dispatcher
+ * thread on a CPU close to the device if it is not running yet.
+ */
+static int
+dispatch_add(struct irq *irq)
+{
+	const uint64_t one = 1;
+	struct epoll_event ev;
+	struct irqdisp *d;
+	int cpu, epfd, error = 0;
+
+	cpu = intr_pickcpu(irq->ud);
+	pthread_mutex_lock(&genericmtx);
+	d = &irqdisps[nextdisp++ % nirqdisps];
+	if (d->epfd == -1 && d->ring == NULL && uring_enabled()) {
+		d->cpu = cpu;
+		if (dispatch_start_uring(d) != 0 && getenv("RUMP_VERBOSE"))
+			printf("io_uring not available for interrupts\n");
+	}
+	if (d->ring) {
+		/*
+		 * The dispatcher picks up newirqs under genericmtx only,
+		 * so the irq can be linked after the wakeup has been
+		 * posted, and does not have to be unlinked again if it
+		 * could not be.
+		 */
+		if (write(d->evfd, &one, sizeof(one)) != sizeof(one)) {
+			error = errno;
+			goto out;
+		}
+		irq->cpu = d->cpu;
+		LIST_INSERT_HEAD(&d->newirqs, irq, newentries);
+		goto out;
+	}
+	if (d->epfd == -1) {
+		if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			error = errno;
+			goto out;
+		}
+		d->epfd = epfd;
+		d->cpu = cpu;
+		if ((error = intr_create(dispthread, d, d->cpu, 1)) != 0) {
+			d->epfd = -1;
+			close(epfd);
+			goto out;
+		}
+	}
+
+	irq->cpu = d->cpu;
+	epfd = d->epfd;
+	pthread_mutex_unlock(&genericmtx);
+
+	/* may go through config space, so not under the lock */
+	intr_start(irq);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = irq;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, irq->fd, &ev) == -1)
+		return errno;
+	return 0;
+
+ out:
+	pthread_mutex_unlock(&genericmtx);
+	return error;
+}
+
+int
+rumpcomp_pci_irq_setpoll(unsigned bus, unsigned dev, unsigned fun,
+	unsigned usec)
+{
+	struct uiodev *ud;
+
+	if ((ud = getdev(bus, dev, fun)) == NULL)
+		return ENOENT;
+	__atomic_store_n(&ud->pollusec, usec, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int
+rumpcomp_pci_irq_stats(unsigned bus, unsigned dev, unsigned fun,
+	struct rumpcomp_pci_irqstats *st)
+{
+	struct uiodev *ud;
+
+	if ((ud = getdev(bus, dev, fun)) == NULL)
+		return ENOENT;
+	st->is_wakeups = __atomic_load_n(&ud->nwakeups, __ATOMIC_RELAXED);
+	st->is_polls = __atomic_load_n(&ud->npolls, __ATOMIC_RELAXED);
+	st->is_pollhits = __atomic_load_n(&ud->npollhits, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int
+rumpcomp_pci_devstats(unsigned bus, unsigned dev, unsigned fun,
+	struct rumpcomp_pci_devstats *st)
+{
+	struct uiodev *ud;
+
+	if ((ud = getdev(bus, dev, fun)) == NULL)
+		return ENOENT;
+	stats_get(ud, st);
+	return 0;
+}
+
+void *
+rumpcomp_pci_irq_establish(unsigned cookie, int (*handler)(void *), void *data)
+{
+	struct irq *irq;
+	char path[PATH_MAX];
+	int fd, error;
+
+	pthread_mutex_lock(&genericmtx);
+	LIST_FOREACH(irq, &irqs, entries) {
+		if (irq->magic_cookie == cookie)
+			break;
+	}
+	pthread_mutex_unlock(&genericmtx);
+	if (!irq)
+		return NULL;
+
+	if (irq->ud->simfd != -1) {
+		if ((fd = dup(irq->ud->simfd)) == -1) {
+			warn("dup simulated interrupt");
+			return NULL;
+		}
+		irq->rsize = sizeof(uint64_t);
+	} else {
+		snprintf(path, sizeof(path), "%s/dev/uio%d",
+		    sysroot, irq->ud->uioidx);
+		fd = open(path, O_RDWR);
+		if (fd == -1) {
+			warn("open %s for intr", path);
+			return NULL;
+		}
+		irq->rsize = sizeof(uint32_t);
+	}
+
+	irq->handler = handler;
+	irq->data = data;
+	irq->fd = fd;
+
+	pthread_once(&dispinit_once, dispatch_init);
+	if (nirqdisps > 0) {
+		error = dispatch_add(irq);
+	} else {
+		irq->cpu = intr_pickcpu(irq->ud);
+		error = intr_create(intrthread, irq, irq->cpu, 1);
+	}
+	if (error != 0) {
+		errno = error;
+		warn("interrupt thread create");
+		free(irq);
+		close(fd);
+		return NULL;
+	}
+
+	if (getenv("RUMP_VERBOSE"))
+		printf("uio%d: interrupt thread on cpu %d\n",
+		    irq->ud->uioidx, irq->cpu);
+
+	return irq;
+}
+
+int
+rumpcomp_pci_sim_intr(unsigned bus, unsigned dev, unsigned fun)
+{
+	const uint64_t one = 1;
+	struct uiodev *ud;
+
+	if ((ud = getdev(bus, dev, fun)) == NULL || ud->simfd == -1)
+		return ENOENT;
+	if (write(ud->simfd, &one, sizeof(one)) != sizeof(one))
+		return errno;
+	return 0;
+}
+
+/*
+ * Translation cache.  The DMA memory we allocate is pinned, so its
+ * physical addresses do not change, and we can remember them instead
+ * of reading /proc/self/pagemap every time bus_dma wants to know.
+ * Each entry covers one physically contiguous (huge)page, and the
+ * entries are kept sorted by virtual address.  Entries are added when
+ * DMA memory is mapped and removed when it is unmapped.  Addresses not
+ * in the cache are looked up from the pagemap.
+ */
+struct xlent {
+	uintptr_t va;
+	size_t len;
+	unsigned long pa;
+};
+static struct xlent *xltab;
+static size_t nxltab, xltabsize;
+static pthread_rwlock_t xltablock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned long pagemap_virt_to_mach(void *);
+
+static size_t
+xlate_find(uintptr_t va)
+{
+	size_t lo = 0, hi = nxltab, mid;
+
+	/* returns the index of the first entry ending after va */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (xltab[mid].va + xltab[mid].len <= va)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void
+xlate_insert(uintptr_t va, size_t len, unsigned long pa)
+{
+	struct xlent *nxl;
+	size_t i;
+
+	pthread_rwlock_wrlock(&xltablock);
+	if (nxltab == xltabsize) {
+		xltabsize = xltabsize ? 2*xltabsize : 64;
+		nxl = realloc(xltab, xltabsize * sizeof(*xltab));
+		if (nxl == NULL) {
+			/* not fatal, we just don't cache this one */
+			xltabsize = nxltab;
+			pthread_rwlock_unlock(&xltablock);
+			return;
+		}
+		xltab = nxl;
+	}
+	i = xlate_find(va);
+	memmove(&xltab[i+1], &xltab[i], (nxltab - i) * sizeof(*xltab));
+	xltab[i].va = va;
+	xltab[i].len = len;
+	xltab[i].pa = pa;
+	nxltab++;
+	pthread_rwlock_unlock(&xltablock);
+}
+
+/* remove all entries in the given range */
+static void
+xlate_remove(uintptr_t va, size_t len)
+{
+	size_t i, n;
+
+	pthread_rwlock_wrlock(&xltablock);
+	i = xlate_find(va);
+	for (n = 0; i+n < nxltab && xltab[i+n].va < va + len; n++)
+		continue;
+	memmove(&xltab[i], &xltab[i+n], (nxltab - i - n) * sizeof(*xltab));
+	nxltab -= n;
+	pthread_rwlock_unlock(&xltablock);
+}
+
+/*
+ * Returns the physical address for va, or 0 if not cached.  If lenp
+ * is given, it is set to the number of contiguous bytes from va on,
+ * or to the distance to the next cached entry if va is not cached.
+ */
+static unsigned long
+xlate_lookup(void *virt, size_t *lenp)
+{
+	uintptr_t va = (uintptr_t)virt;
+	unsigned long pa = 0;
+	size_t i, len = SIZE_MAX;
+
+	pthread_rwlock_rdlock(&xltablock);
+	i = xlate_find(va);
+	if (i < nxltab && xltab[i].va <= va) {
+		pa = xltab[i].pa + (va - xltab[i].va);
+		len = xltab[i].len - (va - xltab[i].va);
+	} else if (i < nxltab) {
+		len = xltab[i].va - va;
+	}
+	pthread_rwlock_unlock(&xltablock);
+
+	if (lenp)
+		*lenp = len;
+	return pa;
+}
+
+/*
+ * DMA memory allocator.  Memory has to be physically contiguous,
+ * which in userspace we can only guarantee within a page, so we
+ * allocate hugepages and carve them into power-of-two size classes
+ * ("slabs").  Since blocks of a class are carved at multiples of
+ * their size from a hugepage-aligned base, they are naturally aligned
+ * to their size, and the alignment requirement can be met by picking
+ * a large enough class.  If no hugepages are available, requests
+ * which fit into a regular page are served from regular pages.
+ *
+ * Requests larger than a hugepage get a dedicated mapping.  Nothing
+ * guarantees that consecutive hugepages are physically adjacent, so
+ * we check that from the pagemap, and if they are not, try a single
+ * hugepage of the next larger size (e.g. 1GB) before giving up.
+ *
+ * The hugepage size used for slabs is the system default, or the one
+ * given in RUMP_PCI_HUGEPAGESIZE (e.g. "2M" or "1G").  Using 1GB pages
+ * for slabs costs memory but saves TLB misses.
+ *
+ * DMA memory is preferably placed on the NUMA node of the device it
+ * is for (see curdev), or on the node given in RUMP_PCI_NUMA_NODE.
+ * Setting RUMP_PCI_NUMA_NODE=-1 disables placement.  Slabs are not
+ * shared between nodes.
+ *
+ * A slab is given back to the system once it is completely free,
+ * unless it is the only one in its class with free space.
+ *
+ * Slabs are backed by memfds so that rumpcomp_pci_dmamem_map() can
+ * map pieces of them again elsewhere.
+ */
+#define DMA_MINSHIFT	6		/* 64 bytes, a cache line */
+#define DMA_MAXSHIFT	40
+#define DMA_NCLASS	(DMA_MAXSHIFT - DMA_MINSHIFT + 1)
+
+struct dmaslab {
+	uint8_t *va;
+	unsigned long pa;
+	size_t len;			/* size of the mapping */
+	size_t pgsz;			/* hugepage size, 0 if none */
+	int contig;			/* physically contiguous? */
+	int node;			/* wanted NUMA node, -1 for any */
+	int fd;				/* backing memfd */
+
+	size_t blksize;			/* 0 for a dedicated mapping */
+	size_t nblks, nfree;
+	uint64_t *freemap;		/* set bit = free block */
+
+	LIST_ENTRY(dmaslab) entries;
+};
+static LIST_HEAD(, dmaslab) dmaslabs[DMA_NCLASS];
+static LIST_HEAD(, dmaslab) dmalarge = LIST_HEAD_INITIALIZER(&dmalarge);
+
+/* address space windows created by rumpcomp_pci_dmamem_map() */
+struct dmawin {
+	uint8_t *va;
+	size_t len;
+
+	LIST_ENTRY(dmawin) entries;
+};
+static LIST_HEAD(, dmawin) dmawins = LIST_HEAD_INITIALIZER(&dmawins);
+static pthread_mutex_t dmamtx = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t hugepagesize;		/* for slabs */
+static size_t largepagesize;		/* next larger size, 0 if none */
+static int dmanode = -2;		/* forced NUMA node, -2 if not */
+static pthread_once_t dmainit_once = PTHREAD_ONCE_INIT;
+
+static struct rumpcomp_pci_dmastats dmastats;
+
+/*
+ * Every live allocation has a record, so that we can report what the
+ * memory is used for and what a driver forgot to free.  Allocations
+ * are stamped with the epoch current at the time, which
+ * rumpcomp_pci_dma_mark() advances.  If a record cannot be allocated,
+ * the allocation just goes untracked.
+ */
+struct dmarec {
+	unsigned long va;
+	size_t size;			/* requested */
+	size_t align;
+	size_t len;			/* allocated */
+	unsigned long epoch;
+	time_t when;			/* CLOCK_MONOTONIC seconds */
+
+	LIST_ENTRY(dmarec) entries;
+};
+#define DMAREC_NHASH	256
+static LIST_HEAD(, dmarec) dmarecs[DMAREC_NHASH];
+static unsigned long dmaepoch = 1;
+
+static size_t
+parsesize(const char *str)
+{
+	unsigned long long sz;
+	char *ep;
+
+	sz = strtoull(str, &ep, 10);
+	switch (*ep) {
+	case 'G': case 'g':
+		sz *= 1024;
+		/*FALLTHROUGH*/
+	case 'M': case 'm':
+		sz *= 1024;
+		/*FALLTHROUGH*/
+	case 'K': case 'k':
+		sz *= 1024;
+		break;
+	}
+	return sz;
+}
+
+/* is a hugepage of the given size configured in the system? */
+static int
+hugepage_avail(size_t size)
+{
+	char path[128];
+
+	snprintf(path, sizeof(path),
+	    "/sys/kernel/mm/hugepages/hugepages-%zukB", size / 1024);
+	return access(path, F_OK) == 0;
+}
+
+static void
+dma_init(void)
+{
+	char line[128];
+	const char *env;
+	struct dirent *dent;
+	unsigned long kb;
+	size_t sz;
+	DIR *dir;
+	FILE *f;
+	int i;
+
+	/* we need to know if devices are simulated */
+	uio_init();
+	for (i = 0; i < DMA_NCLASS; i++)
+		LIST_INIT(&dmaslabs[i]);
+
+	hugepagesize = 2*1024*1024;
+	if ((f = fopen("/proc/meminfo", "r")) != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+				hugepagesize = kb * 1024;
+				break;
+			}
+		}
+		fclose(f);
+	}
+
+	if ((env = getenv("RUMP_PCI_HUGEPAGESIZE")) != NULL) {
+		sz = parsesize(env);
+		if (sz != 0 && (sz & (sz-1)) == 0 && hugepage_avail(sz))
+			hugepagesize = sz;
+		else
+			warnx("RUMP_PCI_HUGEPAGESIZE=%s not available", env);
+	}
+
+	if ((env = getenv("RUMP_PCI_NUMA_NODE")) != NULL)
+		dmanode = atoi(env) < 0 ? -1 : atoi(env);
+
+	if ((dir = opendir("/sys/kernel/mm/hugepages")) == NULL)
+		return;
+	while ((dent = readdir(dir)) != NULL) {
+		if (sscanf(dent->d_name, "hugepages-%lukB", &kb) != 1)
+			continue;
+		sz = kb * 1024;
+		if (sz > hugepagesize && sz > largepagesize)
+			largepagesize = sz;
+	}
+	closedir(dir);
+}
+
+static int
+dma_shift(size_t size)
+{
+	int shift = DMA_MINSHIFT;
+
+	while (((size_t)1 << shift) < size)
+		shift++;
+	return shift;
+}
+
+/* which node should memory allocated now be placed on? */
+static int
+dma_wantnode(void)
+{
+	size_t i;
+	int node;
+
+	if (dmanode != -2)
+		return dmanode;
+	if (curdev != NULL)
+		return curdev->numa_node;
+
+	/* no idea, but if all devices are on the same node, use that */
+	uio_init();
+	for (i = 0, node = -1; i < nuiodevs; i++) {
+		if (i > 0 && uiodevs[i].numa_node != node)
+			return -1;
+		node = uiodevs[i].numa_node;
+	}
+	return node;
+}
+
+/*
+ * Ask for the memory to be placed on the given node.  This is only a
+ * preference, so that we rather get remote memory than no memory.
+ */
+static void
+dma_bind(void *v, size_t len, int node)
+{
+	unsigned long nodemask[1024 / (8*sizeof(unsigned long))];
+
+	if (node < 0 || node >= 1024)
+		return;
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[node / (8*sizeof(unsigned long))] |=
+	    1UL << (node % (8*sizeof(unsigned long)));
+	if (syscall(SYS_mbind, v, len, MPOL_PREFERRED,
+	    nodemask, 1024, 0) == -1)
+		warn("dma: mbind to node %d", node);
+}
+
+/*
+ * Map and pin memory for a slab.  Only the slab itself is locked,
+ * the rest of the process may be paged as usual.  mlock also
+ * populates the memory, which we do only after setting the NUMA
+ * policy.  Returns an errno.
+ */
+static int
+dma_mapslab(struct dmaslab *ds, size_t len, size_t pgsz)
+{
+	unsigned long pa;
+	size_t off;
+	int fd, sverr, mfdflags;
+	void *v;
+
+	/* memfd uses the same page size encoding as mmap */
+	mfdflags = MFD_CLOEXEC;
+	if (pgsz)
+		mfdflags |= MFD_HUGETLB | (ffsl(pgsz)-1) << MAP_HUGE_SHIFT;
+
+	fd = memfd_create("rumpcomp_pci_dma", mfdflags);
+	if (fd == -1)
+		return errno;
+	if (ftruncate(fd, len) == -1) {
+		sverr = errno;
+		close(fd);
+		return sverr;
+	}
+
+	v = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (v == MAP_FAILED) {
+		sverr = errno;
+		close(fd);
+		return sverr;
+	}
+	dma_bind(v, len, ds->node);
+	/* nothing DMAs to simulated devices, no need to pin */
+	if (mlock(v, len) != 0 && !pcisim) {
+		sverr = errno;
+		munmap(v, len);
+		close(fd);
+		return sverr;
+	}
+
+	ds->va = v;
+	ds->len = len;
+	ds->pgsz = pgsz;
+	ds->fd = fd;
+
+	ds->contig = 1;
+	for (off = 0; off < len; off += pgsz ? pgsz : len) {
+		pa = pagemap_virt_to_mach((uint8_t *)v + off);
+		assert(pa);
+		xlate_insert((uintptr_t)v + off, pgsz ? pgsz : len, pa);
+		if (off == 0)
+			ds->pa = pa;
+		else if (pa != ds->pa + off)
+			ds->contig = 0;
+	}
 
-		close(selfmapfd);
-		return error;
+	if (getenv("RUMP_VERBOSE")) {
+		int node = -1;
+
+		syscall(SYS_get_mempolicy, &node, NULL, 0, v,
+		    MPOL_F_NODE | MPOL_F_ADDR);
+		printf("dma: %zu bytes at %p on node %d (wanted %d)\n",
+		    len, v, node, ds->node);
 	}
 
+	dmastats.ds_mapped += len;
+	if (pgsz == hugepagesize)
+		dmastats.ds_hugepages += len / pgsz;
+	else if (pgsz == largepagesize && pgsz)
+		dmastats.ds_largepages += len / pgsz;
+	if (dmastats.ds_mapped > dmastats.ds_peakmapped)
+		dmastats.ds_peakmapped = dmastats.ds_mapped;
+	if (dmastats.ds_hugepages > dmastats.ds_peakhugepages)
+		dmastats.ds_peakhugepages = dmastats.ds_hugepages;
+	if (dmastats.ds_largepages > dmastats.ds_peaklargepages)
+		dmastats.ds_peaklargepages = dmastats.ds_largepages;
+
 	return 0;
 }
 
-void *
-rumpcomp_pci_map(unsigned long addr, unsigned long len)
+static void
+dma_unmapmem(struct dmaslab *ds)
 {
-	char path[128];
-	unsigned long resa;
-	FILE *res;
-	void *mem;
-	int uioidx, residx;
-	int myhighestdev;
-	int fd;
 
-	pthread_mutex_lock(&genericmtx);
-	myhighestdev = highestdev;
-	pthread_mutex_unlock(&genericmtx);
+	xlate_remove((uintptr_t)ds->va, ds->len);
+	munmap(ds->va, ds->len);
+	close(ds->fd);
+	dmastats.ds_mapped -= ds->len;
+	if (ds->pgsz == hugepagesize)
+		dmastats.ds_hugepages -= ds->len / ds->pgsz;
+	else if (ds->pgsz == largepagesize && ds->pgsz)
+		dmastats.ds_largepages -= ds->len / ds->pgsz;
+}
 
-	/*
-	 * We search /sys/class/uio/uio<n>/device/resource for the
-	 * address.  Since this routine is run only during init,
-	 * don't bother with caching the results.
-	 */
-	for (uioidx = 0; uioidx < myhighestdev+1; uioidx++) {
-		snprintf(path, sizeof(path),
-		    "/sys/class/uio/uio%d/device/resource", uioidx);
-		if ((res = fopen(path, "r")) == NULL)
-			continue;
+static void
+dma_unmapslab(struct dmaslab *ds)
+{
 
-		for (residx = 0;
-		    fscanf(res, "%lx %*x %*x\n", &resa) > 0;
-		    residx++) {
-			if (resa == addr)
-				goto found;
-		}
+	dma_unmapmem(ds);
+	free(ds->freemap);
+	free(ds);
+}
+
+/*
+ * Map memory for a dedicated allocation larger than a slab hugepage,
+ * see comment at the top.  Returns an errno.
+ */
+static int
+dma_maplarge(struct dmaslab *ds, size_t size, int node)
+{
+	size_t len;
+	int error;
+
+	ds->node = node;
+	len = (size + hugepagesize-1) & ~(hugepagesize-1);
+	if ((error = dma_mapslab(ds, len, hugepagesize)) == 0) {
+		if (ds->contig)
+			return 0;
+		dma_unmapmem(ds);
+		error = ENOMEM;
 	}
-	return NULL;
 
- found:
-	snprintf(path, sizeof(path),
-	    "/sys/class/uio/uio%d/device/resource%d", uioidx, residx);
-	fd = open(path, O_RDWR);
-	if (fd == -1)
-		return NULL;
+	if (largepagesize && size <= largepagesize
+	    && dma_mapslab(ds, largepagesize, largepagesize) == 0)
+		return 0;
 
-	mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FILE, fd, 0);
-	close(fd);
-	if (mem == MAP_FAILED)
-		return NULL;
+	/* virtual addresses are contiguous for simulated devices */
+	if (pcisim && dma_mapslab(ds, len, 0) == 0)
+		return 0;
 
-	return mem;
+	warnx("dmalloc: cannot get %zu physically contiguous bytes", size);
+	return error;
 }
 
-static int
-openconf(unsigned dev, int mode)
+static struct dmaslab *
+dma_newslab(size_t blksize, int node)
 {
-	char path[128];
-	int fd;
+	const size_t pagesize = getpagesize();
+	struct dmaslab *ds;
+	size_t nwords, i;
+	int error;
 
-	if (snprintf(path, sizeof(path),
-	    "/sys/class/uio/uio%d/device/config",dev) >=(ssize_t)sizeof(path)) {
-		warn("impossibly long path?");
-		return -1;
+	if ((ds = calloc(1, sizeof(*ds))) == NULL)
+		return NULL;
+	ds->node = node;
+
+	error = dma_mapslab(ds, hugepagesize, hugepagesize);
+	/* virtual addresses are contiguous for simulated devices */
+	if (error && pcisim)
+		error = dma_mapslab(ds, hugepagesize, 0);
+	if (error && (blksize > pagesize
+	    || dma_mapslab(ds, pagesize, 0) != 0)) {
+		free(ds);
+		return NULL;
 	}
-	if ((fd = open(path, mode)) == -1) {
-#if 0
-		/* verbose warning */
-		warn("open config space for device %d", dev);
-#endif
-		return -1;
+
+	ds->blksize = blksize;
+	ds->nblks = ds->nfree = ds->len / blksize;
+	nwords = (ds->nblks + 63) / 64;
+	if ((ds->freemap = calloc(nwords, sizeof(*ds->freemap))) == NULL) {
+		dma_unmapslab(ds);
+		return NULL;
 	}
-	return fd;
+	for (i = 0; i < ds->nblks; i++)
+		ds->freemap[i/64] |= 1ULL << (i%64);
+
+	return ds;
 }
 
-int
-rumpcomp_pci_confread(unsigned bus, unsigned dev, unsigned fun,
-	int reg, unsigned int *rv)
+static size_t
+dma_slaballoc(struct dmaslab *ds)
 {
-	int fd;
+	size_t w, blk;
 
-	*rv = 0xffffffff;
-	if (fun != 0 || bus != 0)
-		return 1;
+	assert(ds->nfree > 0);
+	for (w = 0; ds->freemap[w] == 0; w++)
+		continue;
+	blk = w*64 + __builtin_ctzll(ds->freemap[w]);
+	ds->freemap[w] &= ~(1ULL << (blk%64));
+	ds->nfree--;
 
-	if ((fd = openconf(dev, O_RDONLY)) == -1)
-		return 1;
-	if (pread(fd, rv, sizeof(*rv), reg) != 4)
-		warn("pci dev %u config space read", dev);
-	close(fd);
+	return blk * ds->blksize;
+}
 
-	pthread_mutex_lock(&genericmtx);
-	if ((int)dev > highestdev)
-		highestdev = dev;
-	pthread_mutex_unlock(&genericmtx);
+static unsigned
+dma_rechash(unsigned long va)
+{
 
-	return 0;
+	return ((va >> DMA_MINSHIFT) * 0x9e3779b97f4a7c15ULL) >> 56;
+}
+
+static struct dmarec *
+dma_findrec(unsigned long va)
+{
+	struct dmarec *dr;
+
+	LIST_FOREACH(dr, &dmarecs[dma_rechash(va)], entries) {
+		if (dr->va == va)
+			return dr;
+	}
+	return NULL;
 }
 
 int
-rumpcomp_pci_confwrite(unsigned bus, unsigned dev, unsigned fun,
-	int reg, unsigned int v)
+rumpcomp_pci_dmalloc(size_t size, size_t align,
+	unsigned long *pap, unsigned long *vap)
 {
-	int fd;
+	struct dmaslab *ds;
+	struct dmarec *dr;
+	struct timespec ts;
+	size_t off, len;
+	int shift, node, error;
+	uint64_t start = trace_start();
 
-	assert(bus == 0 && fun == 0);
+	pthread_once(&dmainit_once, dma_init);
+	node = dma_wantnode();
 
-	if ((fd = openconf(dev, O_WRONLY)) == -1)
-		return 1;
-	if (pwrite(fd, &v, 4, reg) != 4)
-		warn("pci dev %u config space write", dev);
-	close(fd);
+	if (size == 0)
+		size = 1;
+	shift = dma_shift(size > align ? size : align);
+	dr = malloc(sizeof(*dr));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	return 0;
-}
+	pthread_mutex_lock(&dmamtx);
+	if (((size_t)1 << shift) > hugepagesize) {
+		/* too large for a slab, use a dedicated mapping */
+		if (align > hugepagesize) {
+			error = EINVAL;
+			goto fail;
+		}
+		if ((ds = calloc(1, sizeof(*ds))) == NULL) {
+			error = ENOMEM;
+			goto fail;
+		}
+		if ((error = dma_maplarge(ds, size, node)) != 0) {
+			free(ds);
+			goto fail;
+		}
+		LIST_INSERT_HEAD(&dmalarge, ds, entries);
+		off = 0;
+		len = ds->len;
+	} else {
+		LIST_FOREACH(ds, &dmaslabs[shift - DMA_MINSHIFT], entries) {
+			if (ds->nfree > 0 && ds->node == node)
+				break;
+		}
+		if (ds == NULL) {
+			ds = dma_newslab((size_t)1 << shift, node);
+			if (ds == NULL) {
+				error = ENOMEM;
+				goto fail;
+			}
+			LIST_INSERT_HEAD(&dmaslabs[shift - DMA_MINSHIFT],
+			    ds, entries);
+		}
+		off = dma_slaballoc(ds);
+		len = ds->blksize;
+	}
+	dmastats.ds_allocated += len;
+	dmastats.ds_requested += size;
+	dmastats.ds_nallocs++;
+	dmastats.ds_totallocs++;
+	if (dmastats.ds_allocated > dmastats.ds_peakallocated)
+		dmastats.ds_peakallocated = dmastats.ds_allocated;
 
-/* this is a multifunction data structure! */
-struct irq {
-	unsigned magic_cookie;
-	unsigned device;
+	*vap = (uintptr_t)(ds->va + off);
+	*pap = ds->pa + off;
+	if (dr) {
+		dr->va = *vap;
+		dr->size = size;
+		dr->align = align;
+		dr->len = len;
+		dr->epoch = dmaepoch;
+		dr->when = ts.tv_sec;
+		LIST_INSERT_HEAD(&dmarecs[dma_rechash(*vap)], dr, entries);
+	}
+	pthread_mutex_unlock(&dmamtx);
+	TRACE(dmalloc, PCITRACE_DMALLOC, PCITRACE_NODEV, size, *vap, start);
 
-	int (*handler)(void *);
-	void *data;
-	int fd;
+	return 0;
 
-	LIST_ENTRY(irq) entries;
-};
-static LIST_HEAD(, irq) irqs = LIST_HEAD_INITIALIZER(&irqs);
+ fail:
+	dmastats.ds_failed++;
+	pthread_mutex_unlock(&dmamtx);
+	free(dr);
+	return error;
+}
 
-static void *
-intrthread(void *arg)
+static struct dmaslab *
+dma_findslab(uint8_t *v, int *shiftp)
 {
-	struct irq *irq = arg;
-	const unsigned device = irq->device;
-	int val;
-	int ret;
+	struct dmaslab *ds;
+	int i;
 
-	rumpuser_component_kthread();
-	for (;;) {
-		rumpcomp_pci_confread(0, device, 0, 0x04, &val);
-		if (val & 0x400) {
-			//printf("interrupt disabled!\n");
-			val &= ~0x400;
-			rumpcomp_pci_confwrite(0, device, 0, 0x04, val);
+	for (i = 0; i < DMA_NCLASS; i++) {
+		LIST_FOREACH(ds, &dmaslabs[i], entries) {
+			if (v >= ds->va && v < ds->va + ds->len) {
+				*shiftp = i + DMA_MINSHIFT;
+				return ds;
+			}
 		}
-		ret = read(irq->fd, &val, sizeof(val));
-		if (ret == -1) {
-			warn("read from UIO device %d", irq->device);
-		} else if (ret > 0) {
-			//printf("INTERRUPT!\n");
-			rumpuser_component_schedule(NULL);
-			irq->handler(irq->data);
-			rumpuser_component_unschedule();
-		} else {
-			printf("NOT AN INTERRUPT!\n");
+	}
+	LIST_FOREACH(ds, &dmalarge, entries) {
+		if (v == ds->va) {
+			*shiftp = -1;
+			return ds;
 		}
 	}
 	return NULL;
 }
 
-int
-rumpcomp_pci_irq_map(unsigned bus, unsigned device, unsigned fun,
-	int intrline, unsigned cookie)
+void
+rumpcomp_pci_dmafree(unsigned long vap, size_t size)
 {
-	struct irq *irq;
-	
-	irq = malloc(sizeof(*irq));
-	if (irq == NULL)
-		return ENOENT;
+	struct dmaslab *ds, *ods;
+	struct dmarec *dr;
+	uint8_t *v = (void *)vap;
+	size_t blk;
+	int shift;
 
-	irq->magic_cookie = cookie;
-	irq->device = device;
+	TRACE(dmafree, PCITRACE_DMAFREE, PCITRACE_NODEV, vap, size, 0);
+	pthread_mutex_lock(&dmamtx);
+	if ((ds = dma_findslab(v, &shift)) == NULL) {
+		pthread_mutex_unlock(&dmamtx);
+		warnx("dmafree: %p not allocated by dmalloc", v);
+		return;
+	}
 
-	pthread_mutex_lock(&genericmtx);
-	LIST_INSERT_HEAD(&irqs, irq, entries);
-	pthread_mutex_unlock(&genericmtx);
+	/* trust our own record of the size over the caller's */
+	if ((dr = dma_findrec(vap)) != NULL) {
+		LIST_REMOVE(dr, entries);
+		size = dr->size;
+		free(dr);
+	}
+	dmastats.ds_requested -= size ? size : 1;
+	dmastats.ds_nallocs--;
+	if (shift == -1) {
+		dmastats.ds_allocated -= ds->len;
+		LIST_REMOVE(ds, entries);
+		dma_unmapslab(ds);
+		pthread_mutex_unlock(&dmamtx);
+		return;
+	}
 
-	return 0;
+	blk = (v - ds->va) / ds->blksize;
+	assert((ds->freemap[blk/64] & (1ULL << (blk%64))) == 0);
+	ds->freemap[blk/64] |= 1ULL << (blk%64);
+	ds->nfree++;
+	dmastats.ds_allocated -= ds->blksize;
+
+	if (ds->nfree == ds->nblks) {
+		LIST_FOREACH(ods, &dmaslabs[shift - DMA_MINSHIFT], entries) {
+			if (ods != ds && ods->nfree > 0
+			    && ods->node == ds->node)
+				break;
+		}
+		if (ods != NULL) {
+			LIST_REMOVE(ds, entries);
+			dma_unmapslab(ds);
+		}
+	}
+	pthread_mutex_unlock(&dmamtx);
 }
 
-void *
-rumpcomp_pci_irq_establish(unsigned cookie, int (*handler)(void *), void *data)
+void
+rumpcomp_pci_dmastats(struct rumpcomp_pci_dmastats *st)
 {
-	struct irq *irq;
-	char path[32];
-	pthread_t pt;
-	int fd;
 
-	pthread_mutex_lock(&genericmtx);
-	LIST_FOREACH(irq, &irqs, entries) {
-		if (irq->magic_cookie == cookie)
-			break;
+	pthread_mutex_lock(&dmamtx);
+	*st = dmastats;
+	pthread_mutex_unlock(&dmamtx);
+}
+
+unsigned long
+rumpcomp_pci_dma_mark(void)
+{
+	unsigned long epoch;
+
+	pthread_mutex_lock(&dmamtx);
+	epoch = ++dmaepoch;
+	pthread_mutex_unlock(&dmamtx);
+	return epoch;
+}
+
+struct dmatally {
+	unsigned long n;
+	size_t requested, allocated;
+};
+
+/* account dr to the power-of-two bucket of v */
+static void
+dma_tally(struct dmatally *tab, size_t v, const struct dmarec *dr)
+{
+	int shift = 0;
+
+	while (((size_t)1 << shift) < v && shift < DMA_MAXSHIFT)
+		shift++;
+	tab[shift].n++;
+	tab[shift].requested += dr->size;
+	tab[shift].allocated += dr->len;
+}
+
+static void
+dma_printtally(const char *what, const struct dmatally *tab)
+{
+	int i;
+
+	fprintf(stderr, "dma: %12s %8s %12s %12s\n",
+	    what, "live", "requested", "allocated");
+	for (i = 0; i <= DMA_MAXSHIFT; i++) {
+		if (tab[i].n)
+			fprintf(stderr, "dma: %12zu %8lu %12zu %12zu\n",
+			    (size_t)1 << i, tab[i].n,
+			    tab[i].requested, tab[i].allocated);
 	}
-	pthread_mutex_unlock(&genericmtx);
-	if (!irq)
-		return NULL;
+}
 
-	snprintf(path, sizeof(path), "/dev/uio%d", irq->device);
-	fd = open(path, O_RDWR);
-	if (fd == -1) {
-		warn("open %s for intr", path);
-		return NULL;
+void
+rumpcomp_pci_dma_report(unsigned long since)
+{
+	struct dmatally bylen[DMA_MAXSHIFT+1], byalign[DMA_MAXSHIFT+1];
+	struct rumpcomp_pci_dmastats st;
+	struct dmarec *dr;
+	struct timespec ts;
+	unsigned long freebytes;
+	int i;
+
+	memset(bylen, 0, sizeof(bylen));
+	memset(byalign, 0, sizeof(byalign));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	pthread_mutex_lock(&dmamtx);
+	st = dmastats;
+	for (i = 0; i < DMAREC_NHASH; i++) {
+		LIST_FOREACH(dr, &dmarecs[i], entries) {
+			dma_tally(bylen, dr->len, dr);
+			dma_tally(byalign, dr->align, dr);
+		}
 	}
 
-	irq->handler = handler;
-	irq->data = data;
-	irq->fd = fd;
+	freebytes = st.ds_mapped > st.ds_allocated
+	    ? st.ds_mapped - st.ds_allocated : 0;
+	fprintf(stderr, "dma: %lu live allocations (%lu total, %lu failed)\n",
+	    st.ds_nallocs, st.ds_totallocs, st.ds_failed);
+	fprintf(stderr, "dma: mapped %lu peak %lu, allocated %lu peak %lu, "
+	    "requested %lu\n", st.ds_mapped, st.ds_peakmapped,
+	    st.ds_allocated, st.ds_peakallocated, st.ds_requested);
+	fprintf(stderr, "dma: waste %lu to rounding, %lu free in slabs\n",
+	    st.ds_allocated > st.ds_requested
+	    ? st.ds_allocated - st.ds_requested : 0, freebytes);
+	fprintf(stderr, "dma: %lu hugepages of %zu peak %lu",
+	    st.ds_hugepages, hugepagesize, st.ds_peakhugepages);
+	if (largepagesize)
+		fprintf(stderr, ", %lu of %zu peak %lu", st.ds_largepages,
+		    largepagesize, st.ds_peaklargepages);
+	fprintf(stderr, "\n");
 
-	if (pthread_create(&pt, NULL, intrthread, irq) != 0) {
-		warn("interrupt thread create");
-		free(irq);
-		close(fd);
-		return NULL;
+	dma_printtally("block", bylen);
+	dma_printtally("align", byalign);
+
+	if (since == 0) {
+		pthread_mutex_unlock(&dmamtx);
+		return;
 	}
+	fprintf(stderr, "dma: live allocations since epoch %lu:\n", since);
+	for (i = 0; i < DMAREC_NHASH; i++) {
+		LIST_FOREACH(dr, &dmarecs[i], entries) {
+			if (dr->epoch < since)
+				continue;
+			fprintf(stderr, "dma:   0x%lx size %zu align %zu "
+			    "epoch %lu age %llds\n", dr->va, dr->size,
+			    dr->align, dr->epoch,
+			    (long long)(ts.tv_sec - dr->when));
+		}
+	}
+	pthread_mutex_unlock(&dmamtx);
+}
 
-	return irq;
+/* find the slab containing v, no matter which kind */
+static struct dmaslab *
+dma_findmem(uint8_t *v)
+{
+	struct dmaslab *ds;
+	int shift;
+
+	if ((ds = dma_findslab(v, &shift)) != NULL)
+		return ds;
+	LIST_FOREACH(ds, &dmalarge, entries) {
+		if (v >= ds->va && v < ds->va + ds->len)
+			return ds;
+	}
+	return NULL;
 }
 
 /*
- * Allocate physically contiguous memory.  We could be slightly more
- * efficient here and implement an allocator on top of the
- * hugepages to ensure that they get used more efficiently.  TODO4u
+ * Map the segments one after another into a fresh address space
+ * window, aligned to a hugepage so that hugepage-backed segments can
+ * be placed in it.  Since a mapping of a memfd must start and end on
+ * a page boundary of the backing store, each segment must cover
+ * complete (huge)pages, and must be at a (huge)page aligned offset in
+ * the window.
  */
-int
-rumpcomp_pci_dmalloc(size_t size, size_t align,
-	unsigned long *pap, unsigned long *vap)
+static int
+dma_mapwindow(struct rumpcomp_pci_dmaseg *dss, size_t nseg,
+	size_t totlen, void **vap)
 {
 	const size_t pagesize = getpagesize();
-	void *v;
-	int mmapflags, sverr;
+	struct dmaslab *ds;
+	struct dmawin *dw;
+	uint8_t *v, *win;
+	size_t i, off, pgsz, winlen, walign;
+	int error = 0;
 
-	mmapflags = MAP_ANON|MAP_PRIVATE;
-	if (size > pagesize || align > pagesize) {
-		mmapflags |= MAP_HUGETLB;
+	if ((dw = malloc(sizeof(*dw))) == NULL)
+		return ENOMEM;
+
+	/* align the window for the largest pages we need to map */
+	walign = pagesize;
+	pthread_mutex_lock(&dmamtx);
+	for (i = 0; i < nseg; i++) {
+		ds = dma_findmem((uint8_t *)dss[i].ds_vacookie);
+		if (ds && ds->pgsz > walign)
+			walign = ds->pgsz;
 	}
+	pthread_mutex_unlock(&dmamtx);
 
-	v = mmap(NULL, size, PROT_READ|PROT_WRITE, mmapflags, 0, 0);
-	if (v == MAP_FAILED)
+	winlen = (totlen + pagesize-1) & ~(pagesize-1);
+	v = mmap(NULL, winlen + walign, PROT_NONE,
+	    MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+	if (v == MAP_FAILED) {
+		free(dw);
 		return errno;
-	if (mlockall(MCL_CURRENT|MCL_FUTURE) != 0) {
-		sverr = errno;
-		munmap(v, size);
-		return sverr;
+	}
+	win = (uint8_t *)(((uintptr_t)v + walign-1) & ~(walign-1));
+	if (win != v)
+		munmap(v, win - v);
+	munmap(win + winlen, v + walign - win);
+
+	pthread_mutex_lock(&dmamtx);
+	for (i = 0, off = 0; i < nseg; off += dss[i].ds_len, i++) {
+		v = (uint8_t *)dss[i].ds_vacookie;
+		if ((ds = dma_findmem(v)) == NULL) {
+			error = EINVAL;
+			break;
+		}
+		pgsz = ds->pgsz ? ds->pgsz : pagesize;
+		if ((v - ds->va) % pgsz || dss[i].ds_len % pgsz
+		    || off % pgsz || off + dss[i].ds_len > winlen) {
+			error = ENOTSUP;
+			break;
+		}
+		if (mmap(win + off, dss[i].ds_len, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_FIXED|MAP_POPULATE, ds->fd,
+		    v - ds->va) == MAP_FAILED) {
+			error = errno;
+			break;
+		}
+	}
+	if (error) {
+		pthread_mutex_unlock(&dmamtx);
+		munmap(win, winlen);
+		free(dw);
+		return error;
 	}
 
-	*vap = (uintptr_t)v;
-	*pap = rumpcomp_pci_virt_to_mach(v);
-	assert(*pap);
+	dw->va = win;
+	dw->len = winlen;
+	LIST_INSERT_HEAD(&dmawins, dw, entries);
+	pthread_mutex_unlock(&dmamtx);
 
-	return 0;
-}
+	for (i = 0, off = 0; i < nseg; off += dss[i].ds_len, i++)
+		xlate_insert((uintptr_t)win + off, dss[i].ds_len, dss[i].ds_pa);
 
-void
-rumpcomp_pci_dmafree(unsigned long vap, size_t size)
-{
-	void *v = (void *) vap;
-	munmap(v, size);
+	*vap = win;
+	return 0;
 }
 
 /*
- * "maps" dma memory into virtual address space.  For now, we just
- * rely on it already being mapped.  This means that support for
- * >1 segs is not supported.  We could call mremap() ...
+ * "maps" dma memory into virtual address space.  Segments which are
+ * already virtually contiguous, e.g. the pieces of a single dmalloc
+ * split by physical contiguity, are used where they are.  Otherwise
+ * we map the segments into a new window, see above.
  */
 int
 rumpcomp_pci_dmamem_map(struct rumpcomp_pci_dmaseg *dss, size_t nseg,
 	size_t totlen, void **vap)
 {
+	size_t i;
+	int error;
+
+	for (i = 1; i < nseg; i++) {
+		if (dss[i].ds_vacookie
+		    != dss[i-1].ds_vacookie + dss[i-1].ds_len)
+			break;
+	}
+	if (i == nseg) {
+		*vap = (void *)dss[0].ds_vacookie;
+		return 0;
+	}
+
+	pthread_once(&dmainit_once, dma_init);
+	if ((error = dma_mapwindow(dss, nseg, totlen, vap)) != 0)
+		warnx("dmamem_map for %zu segs: %s", nseg, strerror(error));
+	return error;
+}
+
+void
+rumpcomp_pci_dmamem_unmap(void *va, size_t len)
+{
+	struct dmawin *dw;
 
-	if (nseg > 1) {
-		printf("dmamem_map for >1 seg currently not supported");
-		return ENOTSUP;
+	pthread_mutex_lock(&dmamtx);
+	LIST_FOREACH(dw, &dmawins, entries) {
+		if (dw->va == va)
+			break;
 	}
+	if (dw == NULL) {
+		/* used in place, nothing to do */
+		pthread_mutex_unlock(&dmamtx);
+		return;
+	}
+	LIST_REMOVE(dw, entries);
+	pthread_mutex_unlock(&dmamtx);
 
-	*vap = (void *)dss[0].ds_vacookie;
-	return 0;
+	xlate_remove((uintptr_t)dw->va, dw->len);
+	munmap(dw->va, dw->len);
+	free(dw);
 }
 
 /*
  * Finds the physical address for the given virtual address from
  * /proc/self/pagemap.
  */
-unsigned long
-rumpcomp_pci_virt_to_mach(void *virt)
+static unsigned long
+pagemap_virt_to_mach(void *virt)
 {
 	uint64_t voff, pte;
 	unsigned long paddr = 0;
 	int pagesize, offset;
 
+	if (pcisim)
+		return (uintptr_t)virt;
+
 	(void)*(volatile int *)virt;
 	pagesize = getpagesize();
 	assert((pagesize & (pagesize-1)) == 0);
@@ -368,3 +3712,110 @@ rumpcomp_pci_virt_to_mach(void *virt)
 
 	return paddr;
 }
+
+unsigned long
+rumpcomp_pci_virt_to_mach(void *virt)
+{
+	unsigned long paddr;
+	uint64_t start = trace_start();
+
+	if ((paddr = xlate_lookup(virt, NULL)) == 0)
+		paddr = pagemap_virt_to_mach(virt);
+	TRACE(virt_to_mach, PCITRACE_V2M, PCITRACE_NODEV,
+	    (uintptr_t)virt, paddr, start);
+	return paddr;
+}
+
+static int
+addseg(struct rumpcomp_pci_dmaseg *segs, size_t maxsegs, size_t *nsegs,
+	uintptr_t va, unsigned long pa, size_t len)
+{
+	struct rumpcomp_pci_dmaseg *last;
+
+	if (*nsegs > 0) {
+		last = &segs[*nsegs-1];
+		if (last->ds_pa + last->ds_len == pa) {
+			last->ds_len += len;
+			return 0;
+		}
+	}
+	if (*nsegs == maxsegs)
+		return EFBIG;
+	segs[*nsegs].ds_pa = pa;
+	segs[*nsegs].ds_len = len;
+	segs[*nsegs].ds_vacookie = va;
+	(*nsegs)++;
+	return 0;
+}
+
+/*
+ * Translate a virtual address range into physical segments, merging
+ * physically adjacent pages.  Cached (DMA) memory is translated
+ * without going to the kernel, and for everything else the page
+ * table entries of consecutive pages are read with one pread.
+ * Returns EFBIG if the range does not fit into maxsegs segments.
+ */
+#define PTEBATCH 512
+
+int
+rumpcomp_pci_virt_to_mach_range(void *virt, size_t len,
+	struct rumpcomp_pci_dmaseg *segs, size_t maxsegs, size_t *nsegs)
+{
+	const size_t pagesize = getpagesize();
+	uint64_t ptes[PTEBATCH];
+	uintptr_t va = (uintptr_t)virt, end = va + len, pg;
+	unsigned long pa;
+	size_t avail, n, npages, i;
+	ssize_t nread;
+	int error;
+
+	*nsegs = 0;
+	while (va < end) {
+		if ((pa = xlate_lookup((void *)va, &avail)) != 0) {
+			n = avail < end - va ? avail : end - va;
+			if ((error = addseg(segs, maxsegs, nsegs, va, pa, n)))
+				return error;
+			va += n;
+			continue;
+		}
+
+		/* not cached, read the ptes up to the next cached entry */
+		if (avail > end - va)
+			avail = end - va;
+		if (pcisim) {
+			if ((error = addseg(segs, maxsegs, nsegs,
+			    va, va, avail)))
+				return error;
+			va += avail;
+			continue;
+		}
+		pg = va & ~(pagesize-1);
+		npages = (va + avail - pg + pagesize-1) / pagesize;
+		if (npages > PTEBATCH)
+			npages = PTEBATCH;
+		for (i = 0; i < npages; i++)
+			(void)*(volatile int *)(pg + i*pagesize);
+		nread = pread(selfmapfd, ptes, npages * sizeof(*ptes),
+		    (pg / pagesize) * sizeof(*ptes));
+		if (nread != (ssize_t)(npages * sizeof(*ptes))) {
+			warn("pread");
+			return EFAULT;
+		}
+
+		for (i = 0; i < npages && va < end; i++) {
+			/* paddr is lowest 55 bits, plus offset */
+			pa = (ptes[i] & ((1ULL<<55)-1)) * pagesize;
+			if (pa == 0)
+				return EFAULT;
+			pa += va & (pagesize-1);
+			n = pagesize - (va & (pagesize-1));
+			if (n > end - va)
+				n = end - va;
+			if ((error = addseg(segs, maxsegs, nsegs, va, pa, n)))
+				return error;
+			va += n;
+		}
+	}
+
+	return 0;
+}
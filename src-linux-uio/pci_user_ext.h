@@ -0,0 +1,126 @@
+/*
+ * Hypercalls provided by this PCI component in addition to the
+ * ones declared in pci_user.h.
+ */
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_CONFRANGE
+struct rumpcomp_pci_confop {
+	int reg;
+	unsigned int val;
+};
+
+/* read nregs consecutive 32bit registers starting from reg */
+int rumpcomp_pci_confread_range(unsigned, unsigned, unsigned,
+	int, unsigned int *, size_t);
+/* apply an array of register writes, in order */
+int rumpcomp_pci_confwrite_vec(unsigned, unsigned, unsigned,
+	const struct rumpcomp_pci_confop *, size_t);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_UNMAP
+/* release a mapping returned by rumpcomp_pci_map() */
+void rumpcomp_pci_unmap(void *, unsigned long);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_DMASTATS
+struct rumpcomp_pci_dmastats {
+	unsigned long ds_hugepages;	/* hugepages backing DMA memory */
+	unsigned long ds_largepages;	/* larger (e.g. 1GB) hugepages */
+	unsigned long ds_mapped;	/* bytes mapped for DMA */
+	unsigned long ds_allocated;	/* bytes in allocated blocks */
+	unsigned long ds_requested;	/* bytes requested by callers */
+	unsigned long ds_nallocs;	/* live allocations */
+	unsigned long ds_peakhugepages;
+	unsigned long ds_peaklargepages;
+	unsigned long ds_peakmapped;
+	unsigned long ds_peakallocated;
+	unsigned long ds_totallocs;	/* allocations ever made */
+	unsigned long ds_failed;	/* failed allocations */
+};
+
+void rumpcomp_pci_dmastats(struct rumpcomp_pci_dmastats *);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_DMAREPORT
+/*
+ * Start a new allocation epoch and return its number.  The report
+ * lists the live allocations made in epochs since the given one, so
+ * marking before bringing an interface up and reporting after taking
+ * it down shows what leaked.  The report goes to stderr.  Epochs
+ * start from 1, so since 1 lists all allocations and 0 none.
+ */
+unsigned long rumpcomp_pci_dma_mark(void);
+void rumpcomp_pci_dma_report(unsigned long);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_VIRT_TO_MACH_RANGE
+/*
+ * Translate a virtual address range into at most maxsegs physically
+ * contiguous segments.  Returns 0 or an errno.
+ */
+int rumpcomp_pci_virt_to_mach_range(void *, size_t,
+	struct rumpcomp_pci_dmaseg *, size_t, size_t *);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_DMAMEM_UNMAP
+/* release a mapping created by rumpcomp_pci_dmamem_map() */
+void rumpcomp_pci_dmamem_unmap(void *, size_t);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_IRQ_POLL
+struct rumpcomp_pci_irqstats {
+	unsigned long long is_wakeups;	/* interrupts taken */
+	unsigned long long is_polls;	/* handler calls while polling */
+	unsigned long long is_pollhits;	/* ... which found work */
+};
+
+/* set the busy-poll window in microseconds, 0 disables polling */
+int rumpcomp_pci_irq_setpoll(unsigned, unsigned, unsigned, unsigned);
+int rumpcomp_pci_irq_stats(unsigned, unsigned, unsigned,
+	struct rumpcomp_pci_irqstats *);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_DEVSTATS
+/* latencies in nanoseconds, percentiles are accurate to 12.5% */
+struct rumpcomp_pci_latency {
+	unsigned long long l_count;
+	unsigned long long l_min;
+	unsigned long long l_mean;
+	unsigned long long l_p50;
+	unsigned long long l_p90;
+	unsigned long long l_p99;
+	unsigned long long l_p999;
+	unsigned long long l_max;
+};
+
+struct rumpcomp_pci_devstats {
+	unsigned long long dv_intrs;	/* interrupts received */
+	unsigned long long dv_spurious;	/* wakeups with nothing for us */
+	unsigned long long dv_confreads;	/* registers read */
+	unsigned long long dv_confwrites;	/* registers written */
+	struct rumpcomp_pci_latency dv_intrlat;	/* wakeup to handler */
+	struct rumpcomp_pci_latency dv_handler;	/* handler run time */
+	struct rumpcomp_pci_latency dv_schedwait; /* (un)schedule */
+	struct rumpcomp_pci_latency dv_conflat;	/* config space access */
+};
+
+int rumpcomp_pci_devstats(unsigned, unsigned, unsigned,
+	struct rumpcomp_pci_devstats *);
+/* print the statistics of all devices to stderr */
+void rumpcomp_pci_stats_dump(void);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_TRACE
+/* write the flight recorder to path, see pcitrace.h for the format */
+int rumpcomp_pci_trace_dump(const char *);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_MMIOPROF
+/* print the MMIO profile to stderr, if RUMP_PCI_MMIO_PROF=1 is set */
+void rumpcomp_pci_mmio_report(void);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_SIM
+/* fire the interrupt of a simulated device, see RUMP_PCI_SIM */
+int rumpcomp_pci_sim_intr(unsigned, unsigned, unsigned);
+#endif
@@ -0,0 +1,325 @@
+/*-
+ * Copyright (c) 2026 The pci-userspace contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Create the sysfs tree of simulated uio devices described in a
+ * config file (see example.conf), for running the uio component
+ * without hardware:
+ *
+ *	pcisim example.conf /dev/shm/sim
+ *	RUMP_PCI_SYSROOT=/dev/shm/sim RUMP_PCI_SIM=1 ./program
+ *
+ * Each BAR is a file of its size, so the root should be on tmpfs, in
+ * which case the test can mmap the same file to play the device's
+ * side of the registers.  The config space file holds the IDs, class,
+ * BAR addresses and interrupt line, and the component emulates the
+ * rest of the config space semantics for simulated devices.
+ * Interrupts are fired with rumpcomp_pci_sim_intr().
+ */
+
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <linux/magic.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NBARS		6
+
+/* see linux/ioport.h */
+#define IORESOURCE_IO		0x00000100
+#define IORESOURCE_MEM		0x00000200
+#define IORESOURCE_PREFETCH	0x00002000
+#define IORESOURCE_SIZEALIGN	0x00040000
+#define IORESOURCE_MEM_64	0x00100000
+
+struct simbar {
+	uint64_t base, size;
+	unsigned long flags;
+};
+
+struct simdev {
+	unsigned domain, bus, dev, fun;
+	unsigned vendor, product, class;
+	int irq, numa;
+	int pcie;			/* 4k of config space */
+	char cpus[64];
+	struct simbar bars[NBARS];
+};
+
+static const char *root;
+static int nuio;
+static uint64_t nextmem = 0xe0000000ULL, nextmem64 = 0x800000000ULL;
+static uint64_t nextio = 0x1000;
+
+static void
+mkdirs(const char *path)
+{
+	char buf[PATH_MAX], *p;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	for (p = buf+1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(buf, 0755) == -1 && errno != EEXIST)
+			err(1, "mkdir %s", buf);
+		*p = '/';
+	}
+	if (mkdir(buf, 0755) == -1 && errno != EEXIST)
+		err(1, "mkdir %s", buf);
+}
+
+static void
+writefile(const char *dir, const char *file, const void *data, size_t len)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1)
+		err(1, "%s", path);
+	if (write(fd, data, len) != (ssize_t)len)
+		err(1, "write %s", path);
+	close(fd);
+}
+
+static uint64_t
+parsesize(const char *str)
+{
+	uint64_t sz, p2;
+	char *ep;
+
+	sz = strtoull(str, &ep, 0);
+	switch (*ep) {
+	case 'G': case 'g':
+		sz *= 1024;
+		/*FALLTHROUGH*/
+	case 'M': case 'm':
+		sz *= 1024;
+		/*FALLTHROUGH*/
+	case 'K': case 'k':
+		sz *= 1024;
+		break;
+	}
+	/* BARs are powers of two */
+	for (p2 = 1; p2 < sz; p2 <<= 1)
+		continue;
+	return p2;
+}
+
+static uint64_t
+assign(uint64_t *next, uint64_t size)
+{
+	uint64_t base;
+
+	base = (*next + size-1) & ~(size-1);
+	*next = base + size;
+	return base;
+}
+
+static void
+createdev(struct simdev *sd)
+{
+	char dir[PATH_MAX], link[PATH_MAX], file[32], buf[1024];
+	uint32_t conf[1024], lo;
+	struct simbar *sb;
+	size_t n;
+	int i, fd;
+
+	snprintf(dir, sizeof(dir), "%s/sys/devices/pcisim/%04x:%02x:%02x.%x",
+	    root, sd->domain, sd->bus, sd->dev, sd->fun);
+	mkdirs(dir);
+
+	memset(conf, 0, sizeof(conf));
+	conf[0x00/4] = sd->vendor | sd->product << 16;
+	conf[0x08/4] = sd->class << 8;
+	conf[0x2c/4] = conf[0x00/4];
+	if (sd->irq >= 0)
+		conf[0x3c/4] = (sd->irq & 0xff) | 1 << 8;
+
+	n = 0;
+	for (i = 0; i < NBARS; i++) {
+		sb = &sd->bars[i];
+		if (sb->size) {
+			lo = sb->base;
+			if (sb->flags & IORESOURCE_IO)
+				lo |= 0x1;
+			if (sb->flags & IORESOURCE_MEM_64)
+				lo |= 0x4;
+			if (sb->flags & IORESOURCE_PREFETCH)
+				lo |= 0x8;
+			conf[0x10/4 + i] = lo;
+			if (sb->flags & IORESOURCE_MEM_64)
+				conf[0x10/4 + i+1] = sb->base >> 32;
+
+			snprintf(file, sizeof(file), "resource%d", i);
+			if (snprintf(link, sizeof(link), "%s/%s", dir, file)
+			    >= (int)sizeof(link))
+				errx(1, "%s: path too long", dir);
+			fd = open(link, O_RDWR|O_CREAT|O_TRUNC, 0644);
+			if (fd == -1 || ftruncate(fd, sb->size) == -1)
+				err(1, "%s", link);
+			close(fd);
+		}
+		n += snprintf(buf+n, sizeof(buf)-n,
+		    "0x%016llx 0x%016llx 0x%016llx\n",
+		    (unsigned long long)sb->base,
+		    (unsigned long long)(sb->size ? sb->base + sb->size-1 : 0),
+		    (unsigned long long)sb->flags);
+	}
+	writefile(dir, "resource", buf, n);
+	writefile(dir, "config", conf, sd->pcie ? 4096 : 256);
+
+	n = snprintf(buf, sizeof(buf), "%d\n", sd->irq >= 0 ? sd->irq : 0);
+	writefile(dir, "irq", buf, n);
+	n = snprintf(buf, sizeof(buf), "%d\n", sd->numa);
+	writefile(dir, "numa_node", buf, n);
+	if (sd->cpus[0]) {
+		n = snprintf(buf, sizeof(buf), "%s\n", sd->cpus);
+		writefile(dir, "local_cpulist", buf, n);
+	}
+
+	/* the component finds the pci address from the link target */
+	snprintf(link, sizeof(link), "%s/sys/class/uio/uio%d", root, nuio);
+	mkdirs(link);
+	strncat(link, "/device", sizeof(link) - strlen(link) - 1);
+	unlink(link);
+	if (symlink(dir, link) == -1)
+		err(1, "symlink %s", link);
+	printf("uio%d: %04x:%02x:%02x.%x\n", nuio,
+	    sd->domain, sd->bus, sd->dev, sd->fun);
+	nuio++;
+}
+
+static void
+parsebar(struct simdev *sd, int lineno, char *args)
+{
+	struct simbar *sb;
+	char type[16], size[32], pf[16];
+	int residx, n;
+
+	n = sscanf(args, "%d %15s %31s %15s", &residx, type, size, pf);
+	if (n < 3 || residx < 0 || residx >= NBARS)
+		errx(1, "line %d: bar index type size [prefetch]", lineno);
+	sb = &sd->bars[residx];
+	sb->size = parsesize(size);
+
+	if (strcmp(type, "io") == 0) {
+		sb->flags = IORESOURCE_IO | IORESOURCE_SIZEALIGN;
+		sb->base = assign(&nextio, sb->size);
+		return;
+	}
+	sb->flags = IORESOURCE_MEM | IORESOURCE_SIZEALIGN;
+	if (n == 4 && strcmp(pf, "prefetch") == 0)
+		sb->flags |= IORESOURCE_PREFETCH;
+	if (strcmp(type, "mem64") == 0) {
+		if (residx == NBARS-1)
+			errx(1, "line %d: 64bit BAR %d", lineno, residx);
+		sb->flags |= IORESOURCE_MEM_64;
+		sb->base = assign(&nextmem64, sb->size);
+	} else if (strcmp(type, "mem") == 0) {
+		sb->base = assign(&nextmem, sb->size);
+	} else {
+		errx(1, "line %d: unknown BAR type %s", lineno, type);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct simdev sd;
+	struct statfs sfs;
+	char line[256], *key, *args;
+	int lineno = 0, havedev = 0;
+	FILE *f;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s config root\n", argv[0]);
+		return 1;
+	}
+	if ((f = fopen(argv[1], "r")) == NULL)
+		err(1, "%s", argv[1]);
+	root = argv[2];
+	mkdirs(root);
+	if (statfs(root, &sfs) == 0 && sfs.f_type != TMPFS_MAGIC)
+		warnx("%s is not on tmpfs, BARs are not shared memory", root);
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		line[strcspn(line, "#\n")] = '\0';
+		if ((key = strtok(line, " \t")) == NULL)
+			continue;
+		if ((args = strtok(NULL, "")) == NULL)
+			args = "";
+
+		if (strcmp(key, "device") == 0) {
+			if (havedev)
+				createdev(&sd);
+			memset(&sd, 0, sizeof(sd));
+			sd.irq = -1;
+			sd.numa = -1;
+			if (sscanf(args, "%x:%x:%x.%x", &sd.domain,
+			    &sd.bus, &sd.dev, &sd.fun) != 4)
+				errx(1, "line %d: device dddd:bb:dd.f", lineno);
+			havedev = 1;
+			continue;
+		}
+		if (!havedev)
+			errx(1, "line %d: %s before device", lineno, key);
+
+		if (strcmp(key, "id") == 0) {
+			if (sscanf(args, "%x:%x", &sd.vendor, &sd.product) != 2)
+				errx(1, "line %d: id vendor:product", lineno);
+		} else if (strcmp(key, "class") == 0) {
+			sd.class = strtoul(args, NULL, 16) & 0xffffff;
+		} else if (strcmp(key, "irq") == 0) {
+			sd.irq = atoi(args);
+		} else if (strcmp(key, "numa") == 0) {
+			sd.numa = atoi(args);
+		} else if (strcmp(key, "pcie") == 0) {
+			sd.pcie = 1;
+		} else if (strcmp(key, "cpus") == 0) {
+			sscanf(args, "%63s", sd.cpus);
+		} else if (strcmp(key, "bar") == 0) {
+			parsebar(&sd, lineno, args);
+		} else {
+			errx(1, "line %d: unknown keyword %s", lineno, key);
+		}
+	}
+	if (havedev)
+		createdev(&sd);
+	fclose(f);
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*-
+ * Copyright (c) 2026 The pci-userspace contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Format of the trace dumps written by rumpcomp_pci_trace_dump()
+ * in pci_user-uio_linux.c, and read by pcitrace/pcitrace.c.
+ *
+ * A dump is a header followed by one block per thread, each block
+ * being a struct pcitrace_thr followed by its events, oldest first.
+ * Timestamps are in ticks of the clock the recorder uses (the TSC on
+ * x86), and the header contains two (ticks, ns) pairs for converting
+ * them to CLOCK_MONOTONIC nanoseconds.  Everything is in host byte
+ * order.
+ */
+
+#ifndef _PCITRACE_H_
+#define _PCITRACE_H_
+
+#include <stdint.h>
+
+#define PCITRACE_MAGIC		"RPCITRC1"
+
+#define PCITRACE_CONFREAD	1	/* a0 = reg, a1 = nregs */
+#define PCITRACE_CONFWRITE	2	/* a0 = first reg, a1 = nops */
+#define PCITRACE_MAP		3	/* a0 = bus addr, a1 = len */
+#define PCITRACE_UNMAP		4	/* a0 = va, a1 = len */
+#define PCITRACE_DMALLOC	5	/* a0 = size, a1 = va */
+#define PCITRACE_DMAFREE	6	/* a0 = va, a1 = size */
+#define PCITRACE_V2M		7	/* a0 = va, a1 = pa */
+#define PCITRACE_INTR		8	/* a0 = uio interrupt count */
+#define PCITRACE_HANDLER	9	/* a1 = handler return value */
+#define PCITRACE_NTYPES		10
+
+#define PCITRACE_NODEV		0xffff
+
+struct pcitrace_ent {
+	uint64_t ts;
+	uint64_t a0;
+	uint64_t a1;
+	uint32_t dur;			/* ticks, 0 for instant events */
+	uint16_t type;
+	uint16_t dev;			/* uio index */
+};
+
+struct pcitrace_hdr {
+	char magic[8];
+	uint32_t nthreads;
+	uint32_t pad;
+	uint64_t ticks0, ns0;
+	uint64_t ticks1, ns1;
+};
+
+struct pcitrace_thr {
+	uint32_t tid;
+	uint32_t nents;
+};
+
+#endif /* _PCITRACE_H_ */
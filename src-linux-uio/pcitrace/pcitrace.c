@@ -0,0 +1,122 @@
+/*-
+ * Copyright (c) 2026 The pci-userspace contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Convert a dump written by rumpcomp_pci_trace_dump() into the Chrome
+ * trace event format, which chrome://tracing and Perfetto can load:
+ *
+ *	pcitrace dump > trace.json
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcitrace.h"
+
+static const char *names[PCITRACE_NTYPES] = {
+	[PCITRACE_CONFREAD]	= "confread",
+	[PCITRACE_CONFWRITE]	= "confwrite",
+	[PCITRACE_MAP]		= "map",
+	[PCITRACE_UNMAP]	= "unmap",
+	[PCITRACE_DMALLOC]	= "dmalloc",
+	[PCITRACE_DMAFREE]	= "dmafree",
+	[PCITRACE_V2M]		= "virt_to_mach",
+	[PCITRACE_INTR]		= "intr",
+	[PCITRACE_HANDLER]	= "handler",
+};
+
+static double nsperticks;
+static struct pcitrace_hdr hdr;
+
+/* ticks to microseconds since the recorder started */
+static double
+usec(int64_t ticks)
+{
+
+	return ticks * nsperticks / 1000.0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct pcitrace_thr thr;
+	struct pcitrace_ent te;
+	const char *name;
+	FILE *f;
+	uint32_t t, i;
+	int first = 1;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s dump\n", argv[0]);
+		return 1;
+	}
+	if ((f = fopen(argv[1], "r")) == NULL)
+		err(1, "%s", argv[1]);
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1
+	    || memcmp(hdr.magic, PCITRACE_MAGIC, sizeof(hdr.magic)) != 0)
+		errx(1, "%s: not a trace dump", argv[1]);
+	if (hdr.ticks1 > hdr.ticks0 && hdr.ns1 > hdr.ns0)
+		nsperticks = (double)(hdr.ns1 - hdr.ns0)
+		    / (hdr.ticks1 - hdr.ticks0);
+	else
+		nsperticks = 1.0;
+
+	printf("{\"traceEvents\":[\n");
+	for (t = 0; t < hdr.nthreads; t++) {
+		if (fread(&thr, sizeof(thr), 1, f) != 1)
+			errx(1, "%s: truncated", argv[1]);
+		for (i = 0; i < thr.nents; i++) {
+			if (fread(&te, sizeof(te), 1, f) != 1)
+				errx(1, "%s: truncated", argv[1]);
+			if (te.type < PCITRACE_NTYPES && names[te.type])
+				name = names[te.type];
+			else
+				name = "unknown";
+
+			printf("%s{\"name\":\"%s\",\"cat\":\"pci\","
+			    "\"pid\":1,\"tid\":%" PRIu32 ",\"ts\":%.3f,",
+			    first ? "" : ",\n", name, thr.tid,
+			    usec((int64_t)(te.ts - hdr.ticks0)));
+			if (te.dur)
+				printf("\"ph\":\"X\",\"dur\":%.3f,",
+				    usec(te.dur));
+			else
+				printf("\"ph\":\"i\",\"s\":\"t\",");
+			printf("\"args\":{");
+			if (te.dev != PCITRACE_NODEV)
+				printf("\"dev\":%u,", te.dev);
+			printf("\"a0\":\"0x%" PRIx64 "\",\"a1\":\"0x%"
+			    PRIx64 "\"}}", te.a0, te.a1);
+			first = 0;
+		}
+	}
+	printf("\n]}\n");
+	fclose(f);
+
+	return 0;
+}
@@ -1,2 +1,13 @@
 #define RUMPCOMP_USERFEATURE_PCI_IOSPACE
 #define RUMPCOMP_USERFEATURE_PCI_DMAFREE
+#define RUMPCOMP_USERFEATURE_PCI_CONFRANGE
+#define RUMPCOMP_USERFEATURE_PCI_UNMAP
+#define RUMPCOMP_USERFEATURE_PCI_DMASTATS
+#define RUMPCOMP_USERFEATURE_PCI_VIRT_TO_MACH_RANGE
+#define RUMPCOMP_USERFEATURE_PCI_DMAMEM_UNMAP
+#define RUMPCOMP_USERFEATURE_PCI_IRQ_POLL
+#define RUMPCOMP_USERFEATURE_PCI_DEVSTATS
+#define RUMPCOMP_USERFEATURE_PCI_TRACE
+#define RUMPCOMP_USERFEATURE_PCI_DMAREPORT
+#define RUMPCOMP_USERFEATURE_PCI_MMIOPROF
+#define RUMPCOMP_USERFEATURE_PCI_SIM
@@ -0,0 +1,451 @@
+/*-
+ * Copyright (c) 2026 The pci-userspace contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests for the uio component on the simulated devices of uiotest.conf:
+ * config space reads through the shadow, including the whole 4k of a
+ * PCIe device, vectored config space writes, BAR access, interrupts
+ * and their statistics, and DMA memory.  The interrupt dispatch mode
+ * is given as argument:
+ *
+ *	uiotest thread|epoll|uring
+ *
+ * for a thread per interrupt, an epoll dispatcher and an io_uring
+ * dispatcher.  The mode is picked up when the first interrupt is
+ * established, so each needs a process of its own.  Run with "make
+ * regress", which creates the devices with pcisim for each mode; the
+ * exit status is the number of failed checks.
+ */
+
+#include <sys/mman.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rump/rumpuser_component.h>
+
+#include "pci_user.h"
+#include "pci_user_ext.h"
+
+static int nfail;
+
+#define CHECK(cond)							\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: %s\n", __func__, __LINE__, #cond);	\
+		nfail++;						\
+	}								\
+} while (/*CONSTCOND*/0)
+
+/* see uiotest.conf */
+#define DEV0_ID		0x100e8086
+#define DEV0_BAR0SIZE	(128*1024)
+#define DEV1_ID		0x10001af4
+#define NDEVS		2
+
+static const char *simroot;
+
+static volatile int hits[NDEVS];
+
+static int
+handler(void *arg)
+{
+
+	__atomic_fetch_add(&hits[(intptr_t)arg], 1, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+/* fire the interrupt of device dev and wait for the handler to run */
+static int
+fire(unsigned dev)
+{
+	struct timespec ts = { 0, 1000000 };
+	int i, n;
+
+	n = __atomic_load_n(&hits[dev], __ATOMIC_SEQ_CST);
+	if (rumpcomp_pci_sim_intr(0, dev, 0) != 0)
+		return 0;
+	for (i = 0; i < 1000; i++) {
+		if (__atomic_load_n(&hits[dev], __ATOMIC_SEQ_CST) != n)
+			return 1;
+		nanosleep(&ts, NULL);
+	}
+	return 0;
+}
+
+/* count our descriptors of the given anonymous inode type */
+static int
+nanonfds(const char *type)
+{
+	char path[PATH_MAX], target[64];
+	struct dirent *dp;
+	ssize_t len;
+	DIR *dir;
+	int n = 0;
+
+	if ((dir = opendir("/proc/self/fd")) == NULL)
+		return -1;
+	while ((dp = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), "/proc/self/fd/%s", dp->d_name);
+		len = readlink(path, target, sizeof(target)-1);
+		if (len <= 0)
+			continue;
+		target[len] = '\0';
+		if (strncmp(target, "anon_inode:", 11) == 0
+		    && strcmp(target + 11, type) == 0)
+			n++;
+	}
+	closedir(dir);
+	return n;
+}
+
+static void
+test_setup(void)
+{
+	unsigned int v;
+
+	CHECK(rumpcomp_pci_iospace_init() == 0);
+
+	/* two devices, in the first two slots */
+	CHECK(rumpcomp_pci_confread(0, 0, 0, 0x00, &v) == 0);
+	CHECK(v == DEV0_ID);
+	CHECK(rumpcomp_pci_confread(0, 1, 0, 0x00, &v) == 0);
+	CHECK(v == DEV1_ID);
+	CHECK(rumpcomp_pci_confread(0, 2, 0, 0x00, &v) == 1);
+	CHECK(v == 0xffffffff);
+	CHECK(rumpcomp_pci_confread(0, 0, 1, 0x00, &v) == 1);
+	CHECK(rumpcomp_pci_confread(1, 0, 0, 0x00, &v) == 1);
+}
+
+static void
+test_confread(void)
+{
+	char path[PATH_MAX];
+	unsigned int regs[1024], v;
+	int i, fd;
+
+	/* the same as one at a time, from the file and from the shadow */
+	CHECK(rumpcomp_pci_confread_range(0, 0, 0, 0, regs, 16) == 0);
+	for (i = 0; i < 16; i++) {
+		CHECK(rumpcomp_pci_confread(0, 0, 0, 4*i, &v) == 0);
+		CHECK(v == regs[i]);
+	}
+	CHECK(regs[0] == DEV0_ID);
+	CHECK(regs[0x2c/4] == DEV0_ID);
+	CHECK((regs[0x3c/4] & 0xff) == 11);
+	CHECK(rumpcomp_pci_confread_range(0, 0, 0, 0, regs, 16) == 0);
+	CHECK(regs[0] == DEV0_ID);
+
+	/*
+	 * The whole config space of a PCIe device, past the shadow.
+	 * The extended config space is filled in so that it would show
+	 * if it ended up anywhere else.
+	 */
+	for (i = 0; i < 1024; i++)
+		regs[i] = 0xa5a5a5a5;
+	snprintf(path, sizeof(path), "%s/sys/class/uio/uio0/device/config",
+	    simroot);
+	CHECK((fd = open(path, O_WRONLY)) != -1);
+	CHECK(pwrite(fd, regs, 4096 - 256, 256) == 4096 - 256);
+	close(fd);
+	memset(regs, 0, sizeof(regs));
+	CHECK(rumpcomp_pci_confread_range(0, 0, 0, 0, regs, 1024) == 0);
+	CHECK(regs[0] == DEV0_ID);
+	CHECK(regs[64] == 0xa5a5a5a5 && regs[1023] == 0xa5a5a5a5);
+
+	/* a range crossing the end of the shadowed registers */
+	CHECK(rumpcomp_pci_confread_range(0, 0, 0, 0xf0, regs, 8) == 0);
+	CHECK(regs[3] == 0 && regs[4] == 0xa5a5a5a5);
+
+	/* which must not have run over into the next device */
+	CHECK(rumpcomp_pci_confread(0, 1, 0, 0x00, &v) == 0);
+	CHECK(v == DEV1_ID);
+	CHECK(rumpcomp_pci_confread(0, 0, 0, 0x00, &v) == 0);
+	CHECK(v == DEV0_ID);
+
+	/* device 1 has the conventional 256 bytes */
+	CHECK(rumpcomp_pci_confread_range(0, 1, 0, 0, regs, 64) == 0);
+	CHECK(regs[0] == DEV1_ID && (regs[0x3c/4] & 0xff) == 10);
+}
+
+static void
+test_confwrite(void)
+{
+	struct rumpcomp_pci_confop ops[4];
+	unsigned int bar0, v;
+
+	CHECK(rumpcomp_pci_confread(0, 0, 0, 0x10, &bar0) == 0);
+	CHECK(bar0 != 0 && (bar0 & 0xf) == 0);
+
+	/* size BAR 0 and enable the device in one go */
+	ops[0].reg = 0x10;
+	ops[0].val = 0xffffffff;
+	ops[1].reg = 0x04;
+	ops[1].val = 0x0006;
+	CHECK(rumpcomp_pci_confwrite_vec(0, 0, 0, ops, 2) == 0);
+	CHECK(rumpcomp_pci_confread(0, 0, 0, 0x10, &v) == 0);
+	CHECK(v == (unsigned int)~(DEV0_BAR0SIZE-1));
+	CHECK(rumpcomp_pci_confread(0, 0, 0, 0x04, &v) == 0);
+	CHECK((v & 0xffff) == 0x0006);
+
+	/* in order, so the last write to a register wins */
+	ops[0].reg = 0x10;
+	ops[0].val = 0xffffffff;
+	ops[1].reg = 0x10;
+	ops[1].val = bar0;
+	ops[2].reg = 0x00;
+	ops[2].val = 0;
+	ops[3].reg = 0x40;
+	ops[3].val = 0x12345678;
+	CHECK(rumpcomp_pci_confwrite_vec(0, 0, 0, ops, 4) == 0);
+	CHECK(rumpcomp_pci_confread(0, 0, 0, 0x10, &v) == 0);
+	CHECK(v == bar0);
+	CHECK(rumpcomp_pci_confread(0, 0, 0, 0x00, &v) == 0);
+	CHECK(v == DEV0_ID);
+	CHECK(rumpcomp_pci_confread(0, 0, 0, 0x40, &v) == 0);
+	CHECK(v == 0x12345678);
+
+	/* and only to the device it was meant for */
+	CHECK(rumpcomp_pci_confread(0, 1, 0, 0x40, &v) == 0);
+	CHECK(v == 0);
+	CHECK(rumpcomp_pci_confwrite_vec(0, 2, 0, ops, 4) != 0);
+}
+
+static void
+test_bar(void)
+{
+	char path[PATH_MAX];
+	volatile uint32_t *r, *dev;
+	unsigned int bar0;
+	int fd;
+
+	CHECK(rumpcomp_pci_confread(0, 0, 0, 0x10, &bar0) == 0);
+	r = rumpcomp_pci_map(bar0, DEV0_BAR0SIZE);
+	CHECK(r != NULL);
+	if (r == NULL)
+		return;
+
+	/* the test plays the device through the same file */
+	snprintf(path, sizeof(path),
+	    "%s/sys/class/uio/uio0/device/resource0", simroot);
+	fd = open(path, O_RDWR);
+	CHECK(fd != -1);
+	if (fd == -1)
+		return;
+	dev = mmap(NULL, DEV0_BAR0SIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	close(fd);
+	CHECK(dev != MAP_FAILED);
+	if (dev == MAP_FAILED)
+		return;
+
+	r[1] = 0xdeadbeef;
+	CHECK(dev[1] == 0xdeadbeef);
+	dev[DEV0_BAR0SIZE/4 - 1] = 0x1234;
+	CHECK(r[DEV0_BAR0SIZE/4 - 1] == 0x1234);
+	munmap((void *)dev, DEV0_BAR0SIZE);
+	rumpcomp_pci_unmap((void *)r, DEV0_BAR0SIZE);
+}
+
+static void
+checklat(unsigned dev, unsigned long long n)
+{
+	struct rumpcomp_pci_devstats st;
+	const struct rumpcomp_pci_latency *l = &st.dv_intrlat;
+
+	CHECK(rumpcomp_pci_devstats(0, dev, 0, &st) == 0);
+	CHECK(st.dv_intrs == n && st.dv_spurious == 0);
+	CHECK(l->l_count == n);
+	CHECK(l->l_min <= l->l_p50 && l->l_p50 <= l->l_p90);
+	CHECK(l->l_p90 <= l->l_p99 && l->l_p99 <= l->l_p999);
+	CHECK(l->l_min <= l->l_mean && l->l_mean <= l->l_max);
+
+	/* with fewer than 1000 samples, the 99.9th percentile is the max */
+	CHECK(l->l_p999 == l->l_max);
+}
+
+/* each interrupt to its own handler, whichever way they are dispatched */
+static void
+test_intr(const char *mode)
+{
+	struct rumpcomp_pci_irqstats is;
+	int nuring, nepoll, i;
+
+	nuring = nanonfds("[io_uring]");
+	nepoll = nanonfds("[eventpoll]");
+
+	CHECK(rumpcomp_pci_irq_map(0, 0, 0, 11, 42) == 0);
+	CHECK(rumpcomp_pci_irq_map(0, 1, 0, 10, 43) == 0);
+	CHECK(rumpcomp_pci_irq_establish(44, handler, (void *)0) == NULL);
+	CHECK(rumpcomp_pci_irq_establish(42, handler, (void *)0) != NULL);
+	CHECK(rumpcomp_pci_irq_establish(43, handler, (void *)1) != NULL);
+
+	if (strcmp(mode, "uring") == 0) {
+		CHECK(nanonfds("[io_uring]") == nuring+1);
+		CHECK(nanonfds("[eventpoll]") == nepoll);
+	} else if (strcmp(mode, "epoll") == 0) {
+		CHECK(nanonfds("[io_uring]") == nuring);
+		CHECK(nanonfds("[eventpoll]") == nepoll+1);
+	} else {
+		CHECK(nanonfds("[io_uring]") == nuring);
+		CHECK(nanonfds("[eventpoll]") == nepoll);
+	}
+
+	for (i = 0; i < 100; i++) {
+		CHECK(fire(0));
+		CHECK(fire(1));
+	}
+	CHECK(fire(1));
+	CHECK(hits[0] == 100 && hits[1] == 101);
+	CHECK(rumpcomp_pci_irq_stats(0, 0, 0, &is) == 0);
+	CHECK(is.is_wakeups == 100);
+	CHECK(rumpcomp_pci_irq_stats(0, 1, 0, &is) == 0);
+	CHECK(is.is_wakeups == 101);
+	CHECK(rumpcomp_pci_sim_intr(0, 2, 0) != 0);
+
+	/* the latencies are recorded after the handler has returned */
+	usleep(10000);
+	checklat(0, 100);
+	checklat(1, 101);
+}
+
+static void
+test_dma(void)
+{
+	struct rumpcomp_pci_dmastats st;
+	struct rumpcomp_pci_dmaseg segs[2];
+	unsigned long pa, va, pa2, va2;
+	size_t nsegs;
+	void *win;
+
+	CHECK(rumpcomp_pci_dmalloc(10000, 65536, &pa, &va) == 0);
+	CHECK((pa & 65535) == 0);
+	CHECK(rumpcomp_pci_virt_to_mach((void *)va) == pa);
+	CHECK(rumpcomp_pci_virt_to_mach((void *)(va + 5000)) == pa + 5000);
+	memset((void *)va, 1, 10000);
+
+	/* one block is one segment */
+	CHECK(rumpcomp_pci_virt_to_mach_range((void *)va, 10000,
+	    segs, 2, &nsegs) == 0);
+	CHECK(nsegs == 1);
+	CHECK(segs[0].ds_pa == pa && segs[0].ds_len == 10000);
+
+	CHECK(rumpcomp_pci_dmalloc(4096, 4096, &pa2, &va2) == 0);
+	CHECK(pa2 + 4096 <= pa || pa2 >= pa + 10000);
+	rumpcomp_pci_dmastats(&st);
+	CHECK(st.ds_nallocs == 2);
+	CHECK(st.ds_requested == 10000 + 4096);
+
+	/* a block split into segments is used where it is */
+	segs[0].ds_pa = pa;
+	segs[0].ds_len = 4096;
+	segs[0].ds_vacookie = va;
+	segs[1].ds_pa = pa + 4096;
+	segs[1].ds_len = 10000 - 4096;
+	segs[1].ds_vacookie = va + 4096;
+	CHECK(rumpcomp_pci_dmamem_map(segs, 2, 10000, &win) == 0);
+	CHECK(win == (void *)va);
+	rumpcomp_pci_dmamem_unmap(win, 10000);
+	CHECK(((volatile char *)va)[9999] == 1);
+
+	rumpcomp_pci_dmafree(va, 10000);
+	rumpcomp_pci_dmafree(va2, 4096);
+	rumpcomp_pci_dmastats(&st);
+	CHECK(st.ds_nallocs == 0);
+	CHECK(st.ds_requested == 0 && st.ds_allocated == 0);
+	CHECK(st.ds_totallocs == 2 && st.ds_failed == 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *mode;
+
+	if (argc != 2 || (strcmp(argv[1], "thread") != 0
+	    && strcmp(argv[1], "epoll") != 0
+	    && strcmp(argv[1], "uring") != 0)) {
+		fprintf(stderr, "usage: uiotest thread|epoll|uring\n");
+		return 1;
+	}
+	mode = argv[1];
+	if ((simroot = getenv("RUMP_PCI_SYSROOT")) == NULL) {
+		fprintf(stderr, "uiotest: RUMP_PCI_SYSROOT not set\n");
+		return 1;
+	}
+	if (strcmp(mode, "epoll") == 0)
+		setenv("RUMP_PCI_IRQ_DISPATCH", "1", 1);
+	else if (strcmp(mode, "uring") == 0)
+		setenv("RUMP_PCI_IOURING", "1", 1);
+
+	test_setup();
+	test_confread();
+	test_confwrite();
+	test_bar();
+	test_intr(mode);
+	test_dma();
+
+	printf("uiotest %s: %d failed\n", mode, nfail);
+	return nfail;
+}
+
+/* the component runs without a rump kernel here */
+void
+rumpuser_component_kthread(void)
+{
+
+}
+
+void
+rumpuser_component_kthread_release(void)
+{
+
+}
+
+void *
+rumpuser_component_unschedule(void)
+{
+
+	return NULL;
+}
+
+void
+rumpuser_component_schedule(void *cookie)
+{
+
+}
+
+int
+rumpuser_component_errtrans(int error)
+{
+
+	return error;
+}
@@ -0,0 +1,1370 @@
+/*-
+ * Copyright (c) 2014 Antti Kantee.  All Rights Reserved.
+ * Copyright (c) 2026 The pci-userspace contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * PCI hypercalls on top of Linux VFIO.  Compared to uio, VFIO gives
+ * us every interrupt vector of the device, MSI and MSI-X included,
+ * and puts the device behind the IOMMU, so that neither root nor
+ * physically contiguous memory is required for DMA.
+ *
+ * The devices to use must be bound to vfio-pci before the rump kernel
+ * boots, and all devices of their IOMMU groups must be bound to
+ * vfio-pci (or to no driver at all).
+ */
+
+#define _GNU_SOURCE 1
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+
+#include <linux/vfio.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pci_user.h"
+#include "pci_user_ext.h"
+
+#include <rump/rumpuser_component.h>
+
+#define SYSFS_PCI "/sys/bus/pci"
+
+/* prefix for /sys and /dev, RUMP_PCI_SYSROOT, e.g. for tests */
+static const char *sysroot = "";
+
+static pthread_mutex_t genericmtx = PTHREAD_MUTEX_INITIALIZER;
+
+#define PCI_MAXDEVS 32
+#define PCI_MAXFUNCS 8
+#define PCI_NBARS 6
+
+/*
+ * A BAR is mapped in its entirety the first time any part of it is
+ * requested, and the mapping is shared by all later requests.  The
+ * mapping state is protected by genericmtx.
+ */
+struct vfiobar {
+	unsigned long base;		/* host address, from sysfs */
+	unsigned long size;
+	uint64_t offset;		/* region offset in the device fd */
+	int mmapable;
+
+	void *mem;
+	int refs;
+};
+
+/*
+ * Interrupt vectors.  Each vector signals an eventfd of its own, and
+ * each established vector gets a thread which waits on the eventfd
+ * and runs the handler.  The legacy interface (irq_map/establish)
+ * uses INTx, which VFIO masks when it fires and we unmask after
+ * running the handler.  MSI and MSI-X vectors are established with
+ * rumpcomp_pci_irq_establish_vector().
+ */
+struct vfiovec {
+	struct vfiodev *vd;
+	unsigned index;			/* VFIO_PCI_{INTX,MSI,MSIX}_IRQ_INDEX */
+	unsigned vec;
+
+	int (*handler)(void *);
+	void *data;
+	int fd;				/* eventfd */
+	int cpu;
+};
+
+/*
+ * Everything we know about the devices bound to vfio-pci.  Like in
+ * the uio backend, the table is built once and not changed after
+ * that, and the devices are presented on bus 0, one rump device per
+ * host slot, with functions numbered from 0.
+ */
+struct vfiodev {
+	char name[16];			/* "dddd:bb:dd.f" */
+	unsigned domain, bus, dev, fun;	/* host location */
+	unsigned vdev, vfun;		/* location presented on bus 0 */
+	int fd;				/* VFIO device fd */
+	uint64_t confoff;		/* config space region offset */
+	int numa_node;
+	cpu_set_t localcpus;
+	struct vfiobar bars[PCI_NBARS];
+
+	unsigned nintx;
+	unsigned msiindex;		/* MSI-X if the device has it */
+	unsigned nmsi;			/* vectors at msiindex */
+	int msienabled;			/* protected by genericmtx */
+};
+static struct vfiodev *vfiodevs;
+static size_t nvfiodevs;
+static struct vfiodev *pcislots[PCI_MAXDEVS][PCI_MAXFUNCS];
+
+static int container = -1;
+static pthread_once_t vfioinit_once = PTHREAD_ONCE_INIT;
+
+/* parse a list of CPUs in the "0-3,8,10-11" format used by sysfs */
+static int
+parsecpus(const char *str, cpu_set_t *set)
+{
+	unsigned long lo, hi;
+	char *ep;
+
+	CPU_ZERO(set);
+	while (*str && *str != '\n') {
+		lo = hi = strtoul(str, &ep, 10);
+		if (ep == str)
+			return -1;
+		if (*ep == '-') {
+			str = ep+1;
+			hi = strtoul(str, &ep, 10);
+			if (ep == str || hi < lo)
+				return -1;
+		}
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		str = ep;
+		if (*str == ',')
+			str++;
+	}
+	return 0;
+}
+
+static void
+discover_sysfs(struct vfiodev *vd)
+{
+	char path[128], line[1024];
+	unsigned long long start, end, flags;
+	FILE *f;
+	int residx;
+
+	vd->numa_node = -1;
+	snprintf(path, sizeof(path),
+	    "%s" SYSFS_PCI "/devices/%s/numa_node", sysroot, vd->name);
+	if ((f = fopen(path, "r")) != NULL) {
+		if (fscanf(f, "%d", &vd->numa_node) != 1)
+			vd->numa_node = -1;
+		fclose(f);
+	}
+
+	CPU_ZERO(&vd->localcpus);
+	snprintf(path, sizeof(path),
+	    "%s" SYSFS_PCI "/devices/%s/local_cpulist", sysroot, vd->name);
+	if ((f = fopen(path, "r")) != NULL) {
+		if (fgets(line, sizeof(line), f) == NULL
+		    || parsecpus(line, &vd->localcpus) != 0)
+			CPU_ZERO(&vd->localcpus);
+		fclose(f);
+	}
+
+	/*
+	 * The BAR registers VFIO shows us contain the host addresses,
+	 * so that is what the driver will pass to rumpcomp_pci_map().
+	 */
+	snprintf(path, sizeof(path),
+	    "%s" SYSFS_PCI "/devices/%s/resource", sysroot, vd->name);
+	if ((f = fopen(path, "r")) == NULL)
+		return;
+	for (residx = 0; residx < PCI_NBARS
+	    && fscanf(f, "%llx %llx %llx\n", &start, &end, &flags) == 3;
+	    residx++) {
+		if (end <= start)
+			continue;
+		vd->bars[residx].base = start;
+		vd->bars[residx].size = end - start + 1;
+	}
+	fclose(f);
+}
+
+/* open the group, attaching it to the container, if not done yet */
+static int
+opengroup(const char *name)
+{
+	static struct {
+		int num;
+		int fd;
+	} groups[PCI_MAXDEVS*PCI_MAXFUNCS];
+	static int ngroups;
+	struct vfio_group_status status = { .argsz = sizeof(status) };
+	char path[128], link[256];
+	const char *p;
+	ssize_t n;
+	int i, num, fd, type;
+
+	snprintf(path, sizeof(path),
+	    "%s" SYSFS_PCI "/devices/%s/iommu_group", sysroot, name);
+	if ((n = readlink(path, link, sizeof(link)-1)) == -1) {
+		warn("%s: no iommu group", name);
+		return -1;
+	}
+	link[n] = '\0';
+	p = strrchr(link, '/');
+	num = atoi(p ? p+1 : link);
+
+	for (i = 0; i < ngroups; i++) {
+		if (groups[i].num == num)
+			return groups[i].fd;
+	}
+	if (ngroups == sizeof(groups)/sizeof(groups[0]))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/dev/vfio/%d", sysroot, num);
+	if ((fd = open(path, O_RDWR | O_CLOEXEC)) == -1) {
+		warn("open %s", path);
+		return -1;
+	}
+	if (ioctl(fd, VFIO_GROUP_GET_STATUS, &status) == -1
+	    || (status.flags & VFIO_GROUP_FLAGS_VIABLE) == 0) {
+		warnx("%s: iommu group %d not viable, are all its devices "
+		    "bound to vfio-pci?", name, num);
+		close(fd);
+		return -1;
+	}
+	if (ioctl(fd, VFIO_GROUP_SET_CONTAINER, &container) == -1) {
+		warn("%s: attach group %d", name, num);
+		close(fd);
+		return -1;
+	}
+
+	/* the iommu type can be set once the first group is attached */
+	if (ngroups == 0) {
+		if (ioctl(container, VFIO_CHECK_EXTENSION,
+		    VFIO_TYPE1v2_IOMMU) > 0)
+			type = VFIO_TYPE1v2_IOMMU;
+		else
+			type = VFIO_TYPE1_IOMMU;
+		if (ioctl(container, VFIO_SET_IOMMU, type) == -1) {
+			warn("set iommu type");
+			close(fd);
+			return -1;
+		}
+	}
+
+	groups[ngroups].num = num;
+	groups[ngroups].fd = fd;
+	ngroups++;
+	return fd;
+}
+
+static int
+discover_regions(struct vfiodev *vd)
+{
+	struct vfio_region_info reg = { .argsz = sizeof(reg) };
+	struct vfio_irq_info irq = { .argsz = sizeof(irq) };
+	int residx;
+
+	reg.index = VFIO_PCI_CONFIG_REGION_INDEX;
+	if (ioctl(vd->fd, VFIO_DEVICE_GET_REGION_INFO, &reg) == -1) {
+		warn("%s: config space region", vd->name);
+		return -1;
+	}
+	vd->confoff = reg.offset;
+
+	for (residx = 0; residx < PCI_NBARS; residx++) {
+		reg.index = VFIO_PCI_BAR0_REGION_INDEX + residx;
+		if (ioctl(vd->fd, VFIO_DEVICE_GET_REGION_INFO, &reg) == -1
+		    || reg.size == 0) {
+			vd->bars[residx].size = 0;
+			continue;
+		}
+		vd->bars[residx].offset = reg.offset;
+		vd->bars[residx].mmapable =
+		    (reg.flags & VFIO_REGION_INFO_FLAG_MMAP) != 0;
+	}
+
+	irq.index = VFIO_PCI_INTX_IRQ_INDEX;
+	if (ioctl(vd->fd, VFIO_DEVICE_GET_IRQ_INFO, &irq) == 0)
+		vd->nintx = irq.count;
+	irq.index = VFIO_PCI_MSIX_IRQ_INDEX;
+	if (ioctl(vd->fd, VFIO_DEVICE_GET_IRQ_INFO, &irq) == 0 && irq.count) {
+		vd->msiindex = irq.index;
+		vd->nmsi = irq.count;
+		return 0;
+	}
+	irq.index = VFIO_PCI_MSI_IRQ_INDEX;
+	if (ioctl(vd->fd, VFIO_DEVICE_GET_IRQ_INFO, &irq) == 0) {
+		vd->msiindex = irq.index;
+		vd->nmsi = irq.count;
+	}
+	return 0;
+}
+
+static int
+devcmp(const void *a, const void *b)
+{
+	const struct vfiodev *da = a, *db = b;
+
+	if (da->domain != db->domain)
+		return da->domain < db->domain ? -1 : 1;
+	if (da->bus != db->bus)
+		return da->bus < db->bus ? -1 : 1;
+	if (da->dev != db->dev)
+		return da->dev < db->dev ? -1 : 1;
+	if (da->fun != db->fun)
+		return da->fun < db->fun ? -1 : 1;
+	return 0;
+}
+
+static void
+assign_slots(void)
+{
+	struct vfiodev *vd, *prev = NULL;
+	unsigned vdev = 0, vfun = 0;
+	size_t i;
+
+	for (i = 0; i < nvfiodevs; i++) {
+		vd = &vfiodevs[i];
+		if (prev && (prev->domain != vd->domain
+		    || prev->bus != vd->bus || prev->dev != vd->dev)) {
+			vdev++;
+			vfun = 0;
+		}
+		prev = vd;
+		if (vdev >= PCI_MAXDEVS || vfun >= PCI_MAXFUNCS) {
+			warnx("%s: out of pci slots, ignoring", vd->name);
+			continue;
+		}
+
+		vd->vdev = vdev;
+		vd->vfun = vfun++;
+		pcislots[vd->vdev][vd->vfun] = vd;
+		if (getenv("RUMP_VERBOSE"))
+			printf("vfio: %s at pci bus 0 device %u function %u, "
+			    "%u %s vectors\n", vd->name, vd->vdev, vd->vfun,
+			    vd->nmsi, vd->msiindex == VFIO_PCI_MSIX_IRQ_INDEX
+			    ? "msi-x" : "msi");
+	}
+}
+
+static void iommu_init(void);
+
+/*
+ * Set up the container and snapshot the devices bound to vfio-pci.
+ */
+static void
+vfio_discover(void)
+{
+	struct vfiodev *vd, *nvd;
+	struct dirent *dent;
+	const char *env;
+	char path[128];
+	DIR *dir;
+	size_t nalloc = 0;
+	int groupfd;
+
+	if ((env = getenv("RUMP_PCI_SYSROOT")) != NULL)
+		sysroot = env;
+
+	snprintf(path, sizeof(path), "%s/dev/vfio/vfio", sysroot);
+	if ((container = open(path, O_RDWR | O_CLOEXEC)) == -1) {
+		warn("open %s", path);
+		return;
+	}
+	if (ioctl(container, VFIO_GET_API_VERSION) != VFIO_API_VERSION
+	    || ioctl(container, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU) <= 0) {
+		warnx("unsupported vfio version or iommu");
+		close(container);
+		container = -1;
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s" SYSFS_PCI "/drivers/vfio-pci",
+	    sysroot);
+	if ((dir = opendir(path)) == NULL)
+		return;
+	while ((dent = readdir(dir)) != NULL) {
+		if (nvfiodevs == nalloc) {
+			nalloc = nalloc ? 2*nalloc : 8;
+			nvd = realloc(vfiodevs, nalloc * sizeof(*vfiodevs));
+			if (nvd == NULL) {
+				warn("vfio device table");
+				break;
+			}
+			vfiodevs = nvd;
+		}
+		vd = &vfiodevs[nvfiodevs];
+		memset(vd, 0, sizeof(*vd));
+		if (sscanf(dent->d_name, "%x:%x:%x.%x",
+		    &vd->domain, &vd->bus, &vd->dev, &vd->fun) != 4)
+			continue;
+		snprintf(vd->name, sizeof(vd->name), "%04x:%02x:%02x.%x",
+		    vd->domain, vd->bus, vd->dev, vd->fun);
+
+		if ((groupfd = opengroup(vd->name)) == -1)
+			continue;
+		vd->fd = ioctl(groupfd, VFIO_GROUP_GET_DEVICE_FD, vd->name);
+		if (vd->fd == -1) {
+			warn("%s: get device", vd->name);
+			continue;
+		}
+		discover_sysfs(vd);
+		if (discover_regions(vd) != 0) {
+			close(vd->fd);
+			continue;
+		}
+		nvfiodevs++;
+	}
+	closedir(dir);
+
+	qsort(vfiodevs, nvfiodevs, sizeof(*vfiodevs), devcmp);
+	assign_slots();
+	iommu_init();
+}
+
+static void
+vfio_init(void)
+{
+
+	pthread_once(&vfioinit_once, vfio_discover);
+}
+
+static struct vfiodev *
+getdev(unsigned bus, unsigned dev, unsigned fun)
+{
+
+	vfio_init();
+	if (bus != 0 || dev >= PCI_MAXDEVS || fun >= PCI_MAXFUNCS)
+		return NULL;
+	return pcislots[dev][fun];
+}
+
+/*
+ * Config space.  VFIO virtualizes parts of it (e.g. the MSI and MSI-X
+ * capabilities and BAR sizing) and passes the rest to the device.
+ */
+int
+rumpcomp_pci_confread_range(unsigned bus, unsigned dev, unsigned fun,
+	int reg, unsigned int *rv, size_t nregs)
+{
+	struct vfiodev *vd;
+	const size_t len = nregs * sizeof(*rv);
+	size_t i;
+
+	for (i = 0; i < nregs; i++)
+		rv[i] = 0xffffffff;
+	if ((vd = getdev(bus, dev, fun)) == NULL)
+		return 1;
+
+	if (pread(vd->fd, rv, len, vd->confoff + reg) != (ssize_t)len)
+		warn("%s: config space read", vd->name);
+	return 0;
+}
+
+int
+rumpcomp_pci_confwrite_vec(unsigned bus, unsigned dev, unsigned fun,
+	const struct rumpcomp_pci_confop *ops, size_t nops)
+{
+	struct vfiodev *vd;
+	size_t i;
+
+	if ((vd = getdev(bus, dev, fun)) == NULL)
+		return 1;
+
+	for (i = 0; i < nops; i++) {
+		if (pwrite(vd->fd, &ops[i].val, sizeof(ops[i].val),
+		    vd->confoff + ops[i].reg) != sizeof(ops[i].val))
+			warn("%s: config space write", vd->name);
+	}
+	return 0;
+}
+
+int
+rumpcomp_pci_confread(unsigned bus, unsigned dev, unsigned fun,
+	int reg, unsigned int *rv)
+{
+
+	return rumpcomp_pci_confread_range(bus, dev, fun, reg, rv, 1);
+}
+
+int
+rumpcomp_pci_confwrite(unsigned bus, unsigned dev, unsigned fun,
+	int reg, unsigned int v)
+{
+	struct rumpcomp_pci_confop op = { .reg = reg, .val = v };
+
+	return rumpcomp_pci_confwrite_vec(bus, dev, fun, &op, 1);
+}
+
+/*
+ * BARs are mapped from the device fd.  I/O port BARs cannot be, and
+ * we do not give the rump kernel I/O space, so drivers which need it
+ * are out of luck with this backend.
+ */
+static struct vfiobar *
+barlookup(unsigned long addr, struct vfiodev **vdp)
+{
+	struct vfiodev *vd;
+	struct vfiobar *bar;
+	size_t i;
+	int residx;
+
+	vfio_init();
+	for (i = 0; i < nvfiodevs; i++) {
+		vd = &vfiodevs[i];
+		for (residx = 0; residx < PCI_NBARS; residx++) {
+			bar = &vd->bars[residx];
+			if (bar->size && addr >= bar->base
+			    && addr - bar->base < bar->size) {
+				*vdp = vd;
+				return bar;
+			}
+		}
+	}
+	return NULL;
+}
+
+void *
+rumpcomp_pci_map(unsigned long addr, unsigned long len)
+{
+	struct vfiodev *vd;
+	struct vfiobar *bar;
+	void *mem = NULL;
+
+	if ((bar = barlookup(addr, &vd)) == NULL || !bar->mmapable)
+		return NULL;
+	if (addr - bar->base + len > bar->size)
+		return NULL;
+
+	pthread_mutex_lock(&genericmtx);
+	if (bar->mem == NULL) {
+		bar->mem = mmap(NULL, bar->size, PROT_READ|PROT_WRITE,
+		    MAP_SHARED, vd->fd, bar->offset);
+		if (bar->mem == MAP_FAILED) {
+			warn("%s: map bar", vd->name);
+			bar->mem = NULL;
+			goto out;
+		}
+	}
+	bar->refs++;
+	mem = (uint8_t *)bar->mem + (addr - bar->base);
+ out:
+	pthread_mutex_unlock(&genericmtx);
+	return mem;
+}
+
+void
+rumpcomp_pci_unmap(void *va, unsigned long len)
+{
+	struct vfiodev *vd;
+	struct vfiobar *bar;
+	size_t i;
+	int residx;
+
+	pthread_mutex_lock(&genericmtx);
+	for (i = 0; i < nvfiodevs; i++) {
+		vd = &vfiodevs[i];
+		for (residx = 0; residx < PCI_NBARS; residx++) {
+			bar = &vd->bars[residx];
+			if (bar->mem == NULL
+			    || (uint8_t *)va < (uint8_t *)bar->mem
+			    || (uint8_t *)va >= (uint8_t *)bar->mem + bar->size)
+				continue;
+			if (--bar->refs == 0) {
+				munmap(bar->mem, bar->size);
+				bar->mem = NULL;
+			}
+			goto out;
+		}
+	}
+ out:
+	pthread_mutex_unlock(&genericmtx);
+}
+
+/*
+ * Interrupt threads are placed like in the uio backend: on a CPU
+ * close to the device, or on one of RUMP_PCI_IRQ_CPUS, round-robin,
+ * and at SCHED_FIFO priority RUMP_PCI_IRQ_PRIO if that is set.
+ */
+#define INTR_STACKSIZE	(128*1024)
+
+struct irq {
+	unsigned magic_cookie;
+	struct vfiodev *vd;
+
+	LIST_ENTRY(irq) entries;
+};
+static LIST_HEAD(, irq) irqs = LIST_HEAD_INITIALIZER(&irqs);
+
+static int
+intr_pickcpu(struct vfiodev *vd)
+{
+	static unsigned nextcpu;
+	const char *env;
+	cpu_set_t set, allowed;
+	unsigned n;
+	int cpu, ncpus;
+
+	if ((env = getenv("RUMP_PCI_IRQ_CPUS")) != NULL) {
+		if (parsecpus(env, &set) != 0) {
+			warnx("invalid RUMP_PCI_IRQ_CPUS \"%s\"", env);
+			return -1;
+		}
+	} else {
+		set = vd->localcpus;
+	}
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+		CPU_AND(&set, &set, &allowed);
+	if ((ncpus = CPU_COUNT(&set)) == 0)
+		return -1;
+
+	pthread_mutex_lock(&genericmtx);
+	n = nextcpu++ % ncpus;
+	pthread_mutex_unlock(&genericmtx);
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set) && n-- == 0)
+			break;
+	}
+	return cpu;
+}
+
+static int
+intr_setirqs(struct vfiodev *vd, unsigned index, uint32_t flags,
+	unsigned start, unsigned count, const int32_t *fds)
+{
+	struct vfio_irq_set *set;
+	size_t len;
+	int rv;
+
+	len = sizeof(*set) + (fds ? count * sizeof(*fds) : 0);
+	if ((set = calloc(1, len)) == NULL)
+		return -1;
+	set->argsz = len;
+	set->flags = flags;
+	set->index = index;
+	set->start = start;
+	set->count = count;
+	if (fds)
+		memcpy(set->data, fds, count * sizeof(*fds));
+	rv = ioctl(vd->fd, VFIO_DEVICE_SET_IRQS, set);
+	free(set);
+	return rv;
+}
+
+static void *
+intrthread(void *arg)
+{
+	struct vfiovec *v = arg;
+	uint64_t cnt;
+	ssize_t ret;
+
+	rumpuser_component_kthread();
+	for (;;) {
+		ret = read(v->fd, &cnt, sizeof(cnt));
+		if (ret == -1) {
+			if (errno != EINTR)
+				warn("%s: read interrupt %u",
+				    v->vd->name, v->vec);
+			continue;
+		}
+		rumpuser_component_schedule(NULL);
+		v->handler(v->data);
+		rumpuser_component_unschedule();
+
+		/* INTx is masked by VFIO when it fires */
+		if (v->index == VFIO_PCI_INTX_IRQ_INDEX)
+			intr_setirqs(v->vd, v->index,
+			    VFIO_IRQ_SET_DATA_NONE | VFIO_IRQ_SET_ACTION_UNMASK,
+			    0, 1, NULL);
+	}
+	return NULL;
+}
+
+static int
+intr_create(struct vfiovec *v, int rt)
+{
+	struct sched_param sp;
+	pthread_attr_t attr;
+	pthread_t pt;
+	cpu_set_t set;
+	const char *env;
+	int error;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, INTR_STACKSIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (v->cpu != -1) {
+		CPU_ZERO(&set);
+		CPU_SET(v->cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+	if (rt && (env = getenv("RUMP_PCI_IRQ_PRIO")) != NULL) {
+		sp.sched_priority = atoi(env);
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &sp);
+	}
+
+	error = pthread_create(&pt, &attr, intrthread, v);
+	pthread_attr_destroy(&attr);
+	if (error == EPERM && rt) {
+		warnx("no permission for realtime interrupt thread");
+		error = intr_create(v, 0);
+	}
+	return error;
+}
+
+/*
+ * Route the vector to a new eventfd and start its thread.  VFIO
+ * enables MSI and MSI-X for a block of vectors at a time, so the
+ * first vector established enables all of them, with the others
+ * left unrouted until they are established in turn.
+ */
+static struct vfiovec *
+intr_establish(struct vfiodev *vd, unsigned index, unsigned vec,
+	int (*handler)(void *), void *data)
+{
+	const uint32_t flags =
+	    VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER;
+	struct vfiovec *v;
+	int32_t *fds;
+	unsigned i;
+	int error;
+
+	if ((v = calloc(1, sizeof(*v))) == NULL)
+		return NULL;
+	v->vd = vd;
+	v->index = index;
+	v->vec = vec;
+	v->handler = handler;
+	v->data = data;
+	v->cpu = intr_pickcpu(vd);
+	if ((v->fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+		warn("%s: eventfd", vd->name);
+		free(v);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&genericmtx);
+	if (index == VFIO_PCI_INTX_IRQ_INDEX || vd->msienabled) {
+		error = intr_setirqs(vd, index, flags, vec, 1, &v->fd);
+	} else if ((fds = malloc(vd->nmsi * sizeof(*fds))) == NULL) {
+		error = -1;
+	} else {
+		for (i = 0; i < vd->nmsi; i++)
+			fds[i] = i == vec ? v->fd : -1;
+		error = intr_setirqs(vd, index, flags, 0, vd->nmsi, fds);
+		if (error == 0)
+			vd->msienabled = 1;
+		free(fds);
+	}
+	pthread_mutex_unlock(&genericmtx);
+	if (error == -1) {
+		warn("%s: route interrupt %u", vd->name, vec);
+		goto fail;
+	}
+
+	if ((error = intr_create(v, 1)) != 0) {
+		errno = error;
+		warn("%s: interrupt thread create", vd->name);
+		goto fail;
+	}
+
+	if (getenv("RUMP_VERBOSE"))
+		printf("vfio: %s: interrupt %u thread on cpu %d\n",
+		    vd->name, vec, v->cpu);
+	return v;
+
+ fail:
+	close(v->fd);
+	free(v);
+	return NULL;
+}
+
+int
+rumpcomp_pci_irq_map(unsigned bus, unsigned device, unsigned fun,
+	int intrline, unsigned cookie)
+{
+	struct vfiodev *vd;
+	struct irq *irq;
+
+	if ((vd = getdev(bus, device, fun)) == NULL)
+		return ENOENT;
+
+	irq = malloc(sizeof(*irq));
+	if (irq == NULL)
+		return ENOENT;
+
+	irq->magic_cookie = cookie;
+	irq->vd = vd;
+
+	pthread_mutex_lock(&genericmtx);
+	LIST_INSERT_HEAD(&irqs, irq, entries);
+	pthread_mutex_unlock(&genericmtx);
+
+	return 0;
+}
+
+void *
+rumpcomp_pci_irq_establish(unsigned cookie, int (*handler)(void *), void *data)
+{
+	struct irq *irq;
+
+	pthread_mutex_lock(&genericmtx);
+	LIST_FOREACH(irq, &irqs, entries) {
+		if (irq->magic_cookie == cookie)
+			break;
+	}
+	pthread_mutex_unlock(&genericmtx);
+	if (!irq || irq->vd->nintx == 0)
+		return NULL;
+
+	return intr_establish(irq->vd, VFIO_PCI_INTX_IRQ_INDEX, 0,
+	    handler, data);
+}
+
+int
+rumpcomp_pci_irq_nvectors(unsigned bus, unsigned dev, unsigned fun)
+{
+	struct vfiodev *vd;
+
+	if ((vd = getdev(bus, dev, fun)) == NULL)
+		return 0;
+	return vd->nmsi;
+}
+
+void *
+rumpcomp_pci_irq_establish_vector(unsigned bus, unsigned dev, unsigned fun,
+	unsigned vec, int (*handler)(void *), void *data)
+{
+	struct vfiodev *vd;
+
+	if ((vd = getdev(bus, dev, fun)) == NULL || vec >= vd->nmsi)
+		return NULL;
+	return intr_establish(vd, vd->msiindex, vec, handler, data);
+}
+
+/*
+ * DMA.  The IOMMU translates the addresses the device uses, so any
+ * page can be given to the device, not only hugepages, and nothing
+ * needs to be physically contiguous.  We choose the device addresses
+ * (IOVAs) ourselves.
+ *
+ * At init we reserve a DMA arena of RUMP_PCI_DMA_ARENA bytes (default
+ * 16GB) of address space, and an IOVA range of the same size, both
+ * aligned to 1GB.  The IOVA range is handed out by a first-fit range
+ * allocator.  Memory from dmalloc is placed in the arena at the same
+ * offset as its IOVA, so for it virt_to_mach is plain arithmetic.
+ *
+ * bus_dma also loads other memory, e.g. mbufs.  virt_to_mach maps
+ * the pages it is asked about on first use, at IOVAs from the same
+ * allocator, and remembers them in a table sorted by address.  At most
+ * RUMP_PCI_IOMAP_MAX bytes (default 256MB) of such pages are mapped;
+ * beyond that the least recently looked up page is unmapped to make
+ * room.  The IOMMU pins the pages it maps, so if memory is returned
+ * to the kernel and the address reused while still in the table, the
+ * device sees the old page until the entry is evicted.  The rump
+ * kernel keeps its pool pages, so this concerns only memory that a
+ * driver frees to the host while it is still loaded in a DMA map.
+ */
+#define DMA_ARENA_ALIGN		(1UL<<30)
+#define DMA_ARENA_DEFAULT	(16UL<<30)
+#define IOMAP_DEFAULT		(256UL<<20)
+
+/* used when the kernel does not tell us the valid IOVA ranges */
+#define IOVA_DEFAULT_START	(1ULL<<32)
+#define IOVA_DEFAULT_END	((1ULL<<39)-1)
+
+static uint8_t *arena;
+static size_t arenasize;
+static uint64_t iovabase;
+
+/* free IOVA ranges as offsets from iovabase, sorted, under iovamtx */
+struct iovaseg {
+	uint64_t off;
+	uint64_t len;
+};
+static struct iovaseg *iovafree;
+static size_t niovafree, iovafreesize;
+static pthread_mutex_t iovamtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* pages mapped outside the arena, sorted by va, under iomapslock */
+struct iomap {
+	uintptr_t va;
+	uint64_t iova;
+	uint64_t used;		/* iomapclock at the last lookup */
+};
+static struct iomap *iomaps;
+static size_t niomaps, iomapssize, iomapsmax;
+static uint64_t iomapclock;
+static pthread_rwlock_t iomapslock = PTHREAD_RWLOCK_INITIALIZER;
+
+static size_t
+parsesize(const char *str)
+{
+	unsigned long long sz;
+	char *ep;
+
+	sz = strtoull(str, &ep, 10);
+	switch (*ep) {
+	case 'G': case 'g':
+		sz *= 1024;
+		/*FALLTHROUGH*/
+	case 'M': case 'm':
+		sz *= 1024;
+		/*FALLTHROUGH*/
+	case 'K': case 'k':
+		sz *= 1024;
+		break;
+	}
+	return sz;
+}
+
+/*
+ * Find room for the IOVA range among the ranges the IOMMU can
+ * translate, as reported by the kernel.
+ */
+static int
+iova_pickbase(size_t size)
+{
+	struct vfio_iommu_type1_info *info, *ninfo;
+	struct vfio_info_cap_header *hdr;
+	struct vfio_iommu_type1_info_cap_iova_range *cap = NULL;
+	struct vfio_iova_range def = {
+		.start = IOVA_DEFAULT_START,
+		.end = IOVA_DEFAULT_END,
+	};
+	const struct vfio_iova_range *ranges = &def;
+	uint32_t i, nranges = 1;
+	uint64_t base;
+	size_t off;
+	int rv = -1;
+
+	if ((info = calloc(1, sizeof(*info))) == NULL)
+		return -1;
+	info->argsz = sizeof(*info);
+	if (ioctl(container, VFIO_IOMMU_GET_INFO, info) == 0
+	    && info->argsz > sizeof(*info)
+	    && (ninfo = realloc(info, info->argsz)) != NULL) {
+		info = ninfo;
+		if (ioctl(container, VFIO_IOMMU_GET_INFO, info) == -1)
+			info->flags = 0;
+	} else {
+		info->flags = 0;
+	}
+	if (info->flags & VFIO_IOMMU_INFO_CAPS) {
+		for (off = info->cap_offset; off != 0; off = hdr->next) {
+			hdr = (void *)((uint8_t *)info + off);
+			if (hdr->id == VFIO_IOMMU_TYPE1_INFO_CAP_IOVA_RANGE) {
+				cap = (void *)hdr;
+				break;
+			}
+		}
+	}
+	if (cap && cap->nr_iovas > 0) {
+		ranges = cap->iova_ranges;
+		nranges = cap->nr_iovas;
+	}
+
+	for (i = 0; i < nranges; i++) {
+		/* never use IOVA 0, virt_to_mach returns that on error */
+		base = ranges[i].start ? ranges[i].start : 1;
+		base = (base + DMA_ARENA_ALIGN-1)
+		    & ~(uint64_t)(DMA_ARENA_ALIGN-1);
+		if (base > ranges[i].end || ranges[i].end - base < size-1)
+			continue;
+		iovabase = base;
+		rv = 0;
+		break;
+	}
+	free(info);
+	return rv;
+}
+
+static void
+iommu_init(void)
+{
+	const char *env;
+	uint8_t *v;
+	size_t size;
+
+	iomapsmax = IOMAP_DEFAULT;
+	if ((env = getenv("RUMP_PCI_IOMAP_MAX")) != NULL)
+		iomapsmax = parsesize(env);
+	iomapsmax /= getpagesize();
+
+	size = DMA_ARENA_DEFAULT;
+	if ((env = getenv("RUMP_PCI_DMA_ARENA")) != NULL)
+		size = parsesize(env);
+	size = (size + DMA_ARENA_ALIGN-1) & ~(DMA_ARENA_ALIGN-1);
+	if (size == 0 || iova_pickbase(size) != 0) {
+		warnx("no room for a %zu byte dma arena in the iommu", size);
+		return;
+	}
+
+	/* reserve address space, the memory is mapped by dmalloc */
+	v = mmap(NULL, size + DMA_ARENA_ALIGN, PROT_NONE,
+	    MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+	if (v == MAP_FAILED) {
+		warn("dma arena");
+		return;
+	}
+	arena = (uint8_t *)(((uintptr_t)v + DMA_ARENA_ALIGN-1)
+	    & ~(uintptr_t)(DMA_ARENA_ALIGN-1));
+	if (arena > v)
+		munmap(v, arena - v);
+	munmap(arena + size, (v + DMA_ARENA_ALIGN) - arena);
+
+	if ((iovafree = malloc(16 * sizeof(*iovafree))) == NULL) {
+		munmap(arena, size);
+		arena = NULL;
+		return;
+	}
+	iovafreesize = 16;
+	iovafree[0].off = 0;
+	iovafree[0].len = size;
+	niovafree = 1;
+	arenasize = size;
+
+	if (getenv("RUMP_VERBOSE"))
+		printf("vfio: %zu byte dma arena at %p, iova 0x%" PRIx64 "\n",
+		    arenasize, arena, iovabase);
+}
+
+/* insert a free range at index i */
+static int
+iova_insert(size_t i, uint64_t off, uint64_t len)
+{
+	struct iovaseg *nfree;
+	size_t nsize;
+
+	if (niovafree == iovafreesize) {
+		nsize = 2*iovafreesize;
+		nfree = realloc(iovafree, nsize * sizeof(*iovafree));
+		if (nfree == NULL)
+			return -1;
+		iovafree = nfree;
+		iovafreesize = nsize;
+	}
+	memmove(&iovafree[i+1], &iovafree[i],
+	    (niovafree-i) * sizeof(*iovafree));
+	iovafree[i].off = off;
+	iovafree[i].len = len;
+	niovafree++;
+	return 0;
+}
+
+static void
+iova_delete(size_t i)
+{
+
+	niovafree--;
+	memmove(&iovafree[i], &iovafree[i+1],
+	    (niovafree-i) * sizeof(*iovafree));
+}
+
+/* allocate len bytes of IOVA space, returns the offset or -1 */
+static uint64_t
+iova_alloc(size_t len, size_t align)
+{
+	struct iovaseg *s;
+	uint64_t off, end, rv = (uint64_t)-1;
+	size_t i;
+
+	pthread_mutex_lock(&iovamtx);
+	for (i = 0; i < niovafree; i++) {
+		s = &iovafree[i];
+		off = (s->off + align-1) & ~(uint64_t)(align-1);
+		end = s->off + s->len;
+		if (off >= end || end - off < len)
+			continue;
+
+		/* keep what is left on either side */
+		if (off > s->off && off + len < end) {
+			if (iova_insert(i+1, off+len, end-off-len) != 0)
+				break;
+			iovafree[i].len = off - iovafree[i].off;
+		} else if (off > s->off) {
+			s->len = off - s->off;
+		} else if (off + len < end) {
+			s->off = off + len;
+			s->len = end - s->off;
+		} else {
+			iova_delete(i);
+		}
+		rv = off;
+		break;
+	}
+	pthread_mutex_unlock(&iovamtx);
+	return rv;
+}
+
+static void
+iova_free(uint64_t off, size_t len)
+{
+	size_t i;
+
+	pthread_mutex_lock(&iovamtx);
+	for (i = 0; i < niovafree && iovafree[i].off < off; i++)
+		continue;
+
+	/* merge with the neighbours if possible */
+	if (i > 0 && iovafree[i-1].off + iovafree[i-1].len == off) {
+		iovafree[i-1].len += len;
+		if (i < niovafree && off + len == iovafree[i].off) {
+			iovafree[i-1].len += iovafree[i].len;
+			iova_delete(i);
+		}
+	} else if (i < niovafree && off + len == iovafree[i].off) {
+		iovafree[i].off = off;
+		iovafree[i].len += len;
+	} else if (iova_insert(i, off, len) != 0) {
+		warnx("lost %zu bytes of iova space", len);
+	}
+	pthread_mutex_unlock(&iovamtx);
+}
+
+static int
+iommu_map(uintptr_t va, size_t len, uint64_t iova)
+{
+	struct vfio_iommu_type1_dma_map dm = { .argsz = sizeof(dm) };
+
+	dm.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
+	dm.vaddr = va;
+	dm.iova = iova;
+	dm.size = len;
+	if (ioctl(container, VFIO_IOMMU_MAP_DMA, &dm) == -1)
+		return errno;
+	return 0;
+}
+
+static void
+iommu_unmap(size_t len, uint64_t iova)
+{
+	struct vfio_iommu_type1_dma_unmap du = { .argsz = sizeof(du) };
+
+	du.iova = iova;
+	du.size = len;
+	if (ioctl(container, VFIO_IOMMU_UNMAP_DMA, &du) == -1)
+		warn("iommu unmap");
+}
+
+/* index of the first entry at or after the page pva */
+static size_t
+iomap_find(uintptr_t pva)
+{
+	size_t lo = 0, hi = niomaps, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (iomaps[mid].va < pva)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* return the IOVA of the page pva, or 0, called with iomapslock held */
+static uint64_t
+iomap_lookup(uintptr_t pva)
+{
+	size_t i;
+
+	i = iomap_find(pva);
+	if (i == niomaps || iomaps[i].va != pva)
+		return 0;
+	__atomic_store_n(&iomaps[i].used,
+	    __atomic_add_fetch(&iomapclock, 1, __ATOMIC_RELAXED),
+	    __ATOMIC_RELAXED);
+	return iomaps[i].iova;
+}
+
+/* unmap the least recently used page, called with iomapslock held */
+static void
+iomap_evict(void)
+{
+	const size_t pagesize = getpagesize();
+	size_t i, old = 0;
+
+	for (i = 1; i < niomaps; i++) {
+		if (iomaps[i].used < iomaps[old].used)
+			old = i;
+	}
+	iommu_unmap(pagesize, iomaps[old].iova);
+	iova_free(iomaps[old].iova - iovabase, pagesize);
+	memmove(&iomaps[old], &iomaps[old+1],
+	    (niomaps-old-1) * sizeof(*iomaps));
+	niomaps--;
+}
+
+/* map the page pva, called with iomapslock held */
+static int
+iomap_add(uintptr_t pva)
+{
+	const size_t pagesize = getpagesize();
+	struct iomap *nim;
+	uint64_t off;
+	size_t i, nsize;
+	int error;
+
+	if (iomapsmax == 0)
+		return ENOMEM;
+	if (niomaps == iomapsmax)
+		iomap_evict();
+	if (niomaps == iomapssize) {
+		nsize = iomapssize ? 2*iomapssize : 64;
+		if ((nim = realloc(iomaps, nsize * sizeof(*iomaps))) == NULL)
+			return ENOMEM;
+		iomaps = nim;
+		iomapssize = nsize;
+	}
+
+	if ((off = iova_alloc(pagesize, pagesize)) == (uint64_t)-1)
+		return ENOMEM;
+	if ((error = iommu_map(pva, pagesize, iovabase + off)) != 0) {
+		iova_free(off, pagesize);
+		return error;
+	}
+
+	i = iomap_find(pva);
+	memmove(&iomaps[i+1], &iomaps[i], (niomaps-i) * sizeof(*iomaps));
+	iomaps[i].va = pva;
+	iomaps[i].iova = iovabase + off;
+	iomaps[i].used = __atomic_add_fetch(&iomapclock, 1, __ATOMIC_RELAXED);
+	niomaps++;
+	return 0;
+}
+
+int
+rumpcomp_pci_dmalloc(size_t size, size_t align,
+	unsigned long *pap, unsigned long *vap)
+{
+	const size_t pagesize = getpagesize();
+	uint64_t off;
+	uint8_t *v;
+	size_t len;
+	int error;
+
+	vfio_init();
+	if (arena == NULL)
+		return ENODEV;
+	if (align < pagesize)
+		align = pagesize;
+	if (align & (align-1) || align > DMA_ARENA_ALIGN)
+		return EINVAL;
+	len = (size + pagesize-1) & ~(pagesize-1);
+
+	if ((off = iova_alloc(len, align)) == (uint64_t)-1)
+		return ENOMEM;
+	v = mmap(arena + off, len, PROT_READ|PROT_WRITE,
+	    MAP_FIXED|MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (v == MAP_FAILED) {
+		error = errno;
+		iova_free(off, len);
+		return error;
+	}
+	if ((error = iommu_map((uintptr_t)v, len, iovabase + off)) != 0) {
+		mmap(v, len, PROT_NONE,
+		    MAP_FIXED|MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+		iova_free(off, len);
+		return error;
+	}
+
+	*vap = (uintptr_t)v;
+	*pap = iovabase + off;
+	return 0;
+}
+
+void
+rumpcomp_pci_dmafree(unsigned long vap, size_t size)
+{
+	const size_t pagesize = getpagesize();
+	const size_t len = (size + pagesize-1) & ~(pagesize-1);
+	const uint64_t off = (uint8_t *)vap - arena;
+
+	if ((uint8_t *)vap < arena || off + len > arenasize) {
+		warnx("dmafree: %p not allocated by dmalloc", (void *)vap);
+		return;
+	}
+	iommu_unmap(len, iovabase + off);
+	/* give the memory back but keep the address space reserved */
+	mmap((void *)vap, len, PROT_NONE,
+	    MAP_FIXED|MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+	iova_free(off, len);
+}
+
+int
+rumpcomp_pci_dmamem_map(struct rumpcomp_pci_dmaseg *dss, size_t nseg,
+	size_t totlen, void **vap)
+{
+	size_t i;
+
+	/* segments of one dmalloc allocation are virtually contiguous */
+	for (i = 1; i < nseg; i++) {
+		if (dss[i].ds_vacookie !=
+		    dss[i-1].ds_vacookie + dss[i-1].ds_len) {
+			printf("dmamem_map for >1 seg currently not supported");
+			return ENOTSUP;
+		}
+	}
+
+	*vap = (void *)dss[0].ds_vacookie;
+	return 0;
+}
+
+unsigned long
+rumpcomp_pci_virt_to_mach(void *virt)
+{
+	const size_t pagesize = getpagesize();
+	uintptr_t va = (uintptr_t)virt, pva;
+	uint64_t iova;
+	int error = 0;
+
+	if ((uint8_t *)virt >= arena && (uint8_t *)virt < arena + arenasize)
+		return iovabase + ((uint8_t *)virt - arena);
+	if (arena == NULL)
+		return 0;
+
+	pva = va & ~(uintptr_t)(pagesize-1);
+	pthread_rwlock_rdlock(&iomapslock);
+	iova = iomap_lookup(pva);
+	pthread_rwlock_unlock(&iomapslock);
+	if (iova)
+		return iova + (va - pva);
+
+	pthread_rwlock_wrlock(&iomapslock);
+	/* check again, someone might have beaten us to it */
+	if ((iova = iomap_lookup(pva)) == 0
+	    && (error = iomap_add(pva)) == 0)
+		iova = iomap_lookup(pva);
+	pthread_rwlock_unlock(&iomapslock);
+	if (error) {
+		errno = error;
+		warn("iommu map %p", virt);
+		return 0;
+	}
+	return iova + (va - pva);
+}
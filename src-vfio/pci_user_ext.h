@@ -0,0 +1,31 @@
+/*
+ * Hypercalls provided by this PCI component in addition to the
+ * ones declared in pci_user.h.
+ */
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_CONFRANGE
+struct rumpcomp_pci_confop {
+	int reg;
+	unsigned int val;
+};
+
+/* read nregs consecutive 32bit registers starting from reg */
+int rumpcomp_pci_confread_range(unsigned, unsigned, unsigned,
+	int, unsigned int *, size_t);
+/* apply an array of register writes, in order */
+int rumpcomp_pci_confwrite_vec(unsigned, unsigned, unsigned,
+	const struct rumpcomp_pci_confop *, size_t);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_UNMAP
+/* release a mapping returned by rumpcomp_pci_map() */
+void rumpcomp_pci_unmap(void *, unsigned long);
+#endif
+
+#ifdef RUMPCOMP_USERFEATURE_PCI_IRQ_VECTORS
+/* number of MSI-X (or, failing that, MSI) vectors of the device */
+int rumpcomp_pci_irq_nvectors(unsigned, unsigned, unsigned);
+/* establish a handler for one vector, with a thread of its own */
+void *rumpcomp_pci_irq_establish_vector(unsigned, unsigned, unsigned,
+	unsigned, int (*)(void *), void *);
+#endif
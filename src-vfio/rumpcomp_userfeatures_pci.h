@@ -0,0 +1,4 @@
+#define RUMPCOMP_USERFEATURE_PCI_DMAFREE
+#define RUMPCOMP_USERFEATURE_PCI_CONFRANGE
+#define RUMPCOMP_USERFEATURE_PCI_UNMAP
+#define RUMPCOMP_USERFEATURE_PCI_IRQ_VECTORS
@@ -0,0 +1,373 @@
+/*-
+ * Copyright (c) 2026 The pci-userspace contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A VFIO stand-in for testing the component without an IOMMU.  The
+ * program is linked with -Wl,--wrap=ioctl, so the component's ioctl
+ * calls come here.  mock_init() builds a sysfs and /dev tree with one
+ * device, 0000:03:00.0 in IOMMU group 7, under a temporary directory
+ * and points RUMP_PCI_SYSROOT at it.  The container and group "files"
+ * are plain empty files; the device fd is a memfd holding the config
+ * space at offset 0 and BAR 0 at MOCK_BAR0OFF, laid out like the
+ * regions of vfio-pci.
+ *
+ * The ioctls do what the kernel would and record it in struct mock
+ * for the tests to inspect.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/vfio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rump/rumpuser_component.h>
+
+#include "vfiomock.h"
+
+struct mock mock;
+
+static char root[] = "/tmp/vfiotest.XXXXXX";
+
+static const char *dirs[] = {
+	"/sys",
+	"/sys/bus",
+	"/sys/bus/pci",
+	"/sys/bus/pci/devices",
+	"/sys/bus/pci/devices/" MOCK_DEVNAME,
+	"/sys/bus/pci/drivers",
+	"/sys/bus/pci/drivers/vfio-pci",
+	"/sys/kernel",
+	"/sys/kernel/iommu_groups",
+	"/sys/kernel/iommu_groups/7",
+	"/dev",
+	"/dev/vfio",
+};
+#define NDIRS (sizeof(dirs)/sizeof(dirs[0]))
+
+static const struct {
+	const char *path;
+	const char *contents;
+} files[] = {
+	{ "/sys/bus/pci/devices/" MOCK_DEVNAME "/numa_node", "0\n" },
+	{ "/sys/bus/pci/devices/" MOCK_DEVNAME "/local_cpulist", "0\n" },
+	{ "/sys/bus/pci/devices/" MOCK_DEVNAME "/resource",
+	    "0x00000000fe000000 0x00000000fe000fff 0x0000000000040200\n"
+	    "0x0000000000000000 0x0000000000000000 0x0000000000000000\n"
+	    "0x0000000000000000 0x0000000000000000 0x0000000000000000\n"
+	    "0x0000000000000000 0x0000000000000000 0x0000000000000000\n"
+	    "0x0000000000000000 0x0000000000000000 0x0000000000000000\n"
+	    "0x0000000000000000 0x0000000000000000 0x0000000000000000\n" },
+	{ "/sys/bus/pci/drivers/vfio-pci/bind", "" },
+	{ "/dev/vfio/vfio", "" },
+	{ "/dev/vfio/7", "" },
+};
+#define NFILES (sizeof(files)/sizeof(files[0]))
+
+static const struct {
+	const char *path;
+	const char *target;
+} links[] = {
+	{ "/sys/bus/pci/devices/" MOCK_DEVNAME "/iommu_group",
+	    "../../../../kernel/iommu_groups/7" },
+	{ "/sys/bus/pci/drivers/vfio-pci/" MOCK_DEVNAME,
+	    "../../devices/" MOCK_DEVNAME },
+};
+#define NLINKS (sizeof(links)/sizeof(links[0]))
+
+static void
+rootpath(char *path, size_t len, const char *p)
+{
+
+	snprintf(path, len, "%s%s", root, p);
+}
+
+static void
+mock_cleanup(void)
+{
+	char path[256];
+	int i;
+
+	for (i = NLINKS-1; i >= 0; i--) {
+		rootpath(path, sizeof(path), links[i].path);
+		unlink(path);
+	}
+	for (i = NFILES-1; i >= 0; i--) {
+		rootpath(path, sizeof(path), files[i].path);
+		unlink(path);
+	}
+	for (i = NDIRS-1; i >= 0; i--) {
+		rootpath(path, sizeof(path), dirs[i]);
+		rmdir(path);
+	}
+	rmdir(root);
+}
+
+void
+mock_init(void)
+{
+	static const uint32_t conf[] = {
+		0x10d38086,	/* device, vendor */
+		0x00100000,	/* status, command */
+		0x02000000,	/* class */
+		0x00000000,
+		0xfe000000,	/* BAR 0 */
+	};
+	char path[256];
+	size_t i;
+	FILE *f;
+	int j;
+
+	if (mkdtemp(root) == NULL)
+		err(1, "mkdtemp");
+	atexit(mock_cleanup);
+	for (i = 0; i < NDIRS; i++) {
+		rootpath(path, sizeof(path), dirs[i]);
+		if (mkdir(path, 0755) == -1)
+			err(1, "mkdir %s", path);
+	}
+	for (i = 0; i < NFILES; i++) {
+		rootpath(path, sizeof(path), files[i].path);
+		if ((f = fopen(path, "w")) == NULL)
+			err(1, "create %s", path);
+		fputs(files[i].contents, f);
+		fclose(f);
+	}
+	for (i = 0; i < NLINKS; i++) {
+		rootpath(path, sizeof(path), links[i].path);
+		if (symlink(links[i].target, path) == -1)
+			err(1, "symlink %s", path);
+	}
+	setenv("RUMP_PCI_SYSROOT", root, 1);
+
+	if ((mock.devfd = memfd_create("vfiodev", MFD_CLOEXEC)) == -1)
+		err(1, "memfd_create");
+	if (ftruncate(mock.devfd, MOCK_BAR0OFF + MOCK_BAR0SIZE) == -1)
+		err(1, "ftruncate");
+	if (pwrite(mock.devfd, conf, sizeof(conf), 0) != sizeof(conf))
+		err(1, "write config space");
+
+	for (j = 0; j < MOCK_NMSIX; j++)
+		mock.msixfd[j] = -1;
+	mock.intxfd = -1;
+}
+
+static int
+mock_setirqs(struct vfio_irq_set *set)
+{
+	const int32_t *fds = (const int32_t *)set->data;
+	unsigned i;
+
+	switch (set->flags) {
+	case VFIO_IRQ_SET_DATA_NONE | VFIO_IRQ_SET_ACTION_UNMASK:
+		if (set->index != VFIO_PCI_INTX_IRQ_INDEX)
+			break;
+		mock.nunmask++;
+		return 0;
+
+	case VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER:
+		if (set->index == VFIO_PCI_INTX_IRQ_INDEX) {
+			if (set->start != 0 || set->count != 1)
+				break;
+			mock.intxfd = fds[0];
+			return 0;
+		}
+		if (set->index != VFIO_PCI_MSIX_IRQ_INDEX
+		    || set->start + set->count > MOCK_NMSIX)
+			break;
+		/* enabling sets the block size, routing stays within it */
+		if (mock.nmsixenabled == 0) {
+			if (set->start != 0)
+				break;
+			mock.nmsixenabled = set->count;
+		} else if (set->start + set->count > mock.nmsixenabled) {
+			break;
+		}
+		for (i = 0; i < set->count; i++)
+			mock.msixfd[set->start + i] = fds[i];
+		mock.nmsixsets++;
+		return 0;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+int __wrap_ioctl(int, unsigned long, ...);
+
+int
+__wrap_ioctl(int fd, unsigned long req, ...)
+{
+	struct vfio_group_status *gs;
+	struct vfio_region_info *ri;
+	struct vfio_irq_info *ii;
+	struct vfio_iommu_type1_dma_map *dm;
+	struct vfio_iommu_type1_dma_unmap *du;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, req);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	switch (req) {
+	case VFIO_GET_API_VERSION:
+		mock.container = fd;
+		return VFIO_API_VERSION;
+
+	case VFIO_CHECK_EXTENSION:
+		return (uintptr_t)arg == VFIO_TYPE1_IOMMU
+		    || (uintptr_t)arg == VFIO_TYPE1v2_IOMMU;
+
+	case VFIO_GROUP_GET_STATUS:
+		gs = arg;
+		gs->flags = VFIO_GROUP_FLAGS_VIABLE;
+		if (mock.groupattached)
+			gs->flags |= VFIO_GROUP_FLAGS_CONTAINER_SET;
+		return 0;
+
+	case VFIO_GROUP_SET_CONTAINER:
+		if (*(int *)arg != mock.container)
+			break;
+		mock.groupattached = 1;
+		return 0;
+
+	case VFIO_SET_IOMMU:
+		/* the kernel wants a group in the container first */
+		if (fd != mock.container || !mock.groupattached)
+			break;
+		mock.iommutype = (uintptr_t)arg;
+		return 0;
+
+	case VFIO_GROUP_GET_DEVICE_FD:
+		if (mock.iommutype == 0 || strcmp(arg, MOCK_DEVNAME) != 0)
+			break;
+		mock.ndevfds++;
+		return dup(mock.devfd);
+
+	case VFIO_DEVICE_GET_REGION_INFO:
+		ri = arg;
+		ri->flags = 0;
+		ri->offset = 0;
+		ri->size = 0;
+		if (ri->index == VFIO_PCI_CONFIG_REGION_INDEX) {
+			ri->size = 256;
+			ri->flags = VFIO_REGION_INFO_FLAG_READ
+			    | VFIO_REGION_INFO_FLAG_WRITE;
+		} else if (ri->index == VFIO_PCI_BAR0_REGION_INDEX) {
+			ri->offset = MOCK_BAR0OFF;
+			ri->size = MOCK_BAR0SIZE;
+			ri->flags = VFIO_REGION_INFO_FLAG_READ
+			    | VFIO_REGION_INFO_FLAG_WRITE
+			    | VFIO_REGION_INFO_FLAG_MMAP;
+		}
+		return 0;
+
+	case VFIO_DEVICE_GET_IRQ_INFO:
+		ii = arg;
+		ii->flags = VFIO_IRQ_INFO_EVENTFD;
+		if (ii->index == VFIO_PCI_INTX_IRQ_INDEX)
+			ii->count = 1;
+		else if (ii->index == VFIO_PCI_MSIX_IRQ_INDEX)
+			ii->count = MOCK_NMSIX;
+		else
+			ii->count = 0;
+		return 0;
+
+	case VFIO_DEVICE_SET_IRQS:
+		return mock_setirqs(arg);
+
+	case VFIO_IOMMU_GET_INFO:
+		/* no IOVA range capability, use the default range */
+		((struct vfio_iommu_type1_info *)arg)->flags = 0;
+		return 0;
+
+	case VFIO_IOMMU_MAP_DMA:
+		dm = arg;
+		if (fd != mock.container || mock.iommutype == 0
+		    || (dm->vaddr | dm->iova | dm->size) & 4095
+		    || dm->flags != (VFIO_DMA_MAP_FLAG_READ
+		    | VFIO_DMA_MAP_FLAG_WRITE))
+			break;
+		mock.nmaps++;
+		mock.lastmap.vaddr = dm->vaddr;
+		mock.lastmap.iova = dm->iova;
+		mock.lastmap.size = dm->size;
+		mock.mapped += dm->size;
+		return 0;
+
+	case VFIO_IOMMU_UNMAP_DMA:
+		du = arg;
+		if (fd != mock.container || du->size > mock.mapped)
+			break;
+		mock.nunmaps++;
+		mock.lastunmap.iova = du->iova;
+		mock.lastunmap.size = du->size;
+		mock.mapped -= du->size;
+		return 0;
+
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/* the component runs without a rump kernel here */
+void
+rumpuser_component_kthread(void)
+{
+
+}
+
+void
+rumpuser_component_kthread_release(void)
+{
+
+}
+
+void *
+rumpuser_component_unschedule(void)
+{
+
+	return NULL;
+}
+
+void
+rumpuser_component_schedule(void *cookie)
+{
+
+}
@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2026 The pci-userspace contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _VFIOMOCK_H_
+#define _VFIOMOCK_H_
+
+#include <stdint.h>
+
+#define MOCK_DEVNAME	"0000:03:00.0"
+#define MOCK_BAR0BASE	0xfe000000UL
+#define MOCK_BAR0OFF	0x10000
+#define MOCK_BAR0SIZE	0x1000
+#define MOCK_NMSIX	8
+
+/* what the component asked of VFIO */
+struct mock {
+	int devfd;		/* our side of the device */
+	int container;
+	int groupattached;
+	unsigned long iommutype;
+	int ndevfds;
+
+	int intxfd;
+	int nunmask;
+	int msixfd[MOCK_NMSIX];
+	unsigned nmsixenabled;
+	int nmsixsets;
+
+	int nmaps, nunmaps;
+	uint64_t mapped;	/* bytes mapped in the iommu */
+	struct {
+		uint64_t vaddr, iova, size;
+	} lastmap, lastunmap;
+};
+extern struct mock mock;
+
+void	mock_init(void);
+
+#endif /* _VFIOMOCK_H_ */
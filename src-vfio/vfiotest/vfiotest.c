@@ -0,0 +1,323 @@
+/*-
+ * Copyright (c) 2026 The pci-userspace contributors.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests for the VFIO component against the ioctl stand-in in
+ * vfiomock.c: container, group and device setup, config space and
+ * BAR access, per-vector MSI-X routing, INTx, DMA mapping, and the
+ * on-demand mapping of memory from outside the DMA arena.
+ * Run with "make regress"; the exit status is the number of failed
+ * checks.
+ */
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pci_user.h"
+#include "pci_user_ext.h"
+
+#include "vfiomock.h"
+
+static int nfail;
+
+#define CHECK(cond)							\
+do {									\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: %s\n", __func__, __LINE__, #cond);	\
+		nfail++;						\
+	}								\
+} while (/*CONSTCOND*/0)
+
+static volatile int hits[MOCK_NMSIX+1];
+
+static int
+handler(void *arg)
+{
+
+	__atomic_fetch_add(&hits[(intptr_t)arg], 1, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+/* fire the interrupt and wait for the handler to have run */
+static int
+fire(int fd, int idx)
+{
+	const uint64_t one = 1;
+	struct timespec ts = { 0, 1000000 };
+	int i, n;
+
+	n = __atomic_load_n(&hits[idx], __ATOMIC_SEQ_CST);
+	if (fd == -1 || write(fd, &one, sizeof(one)) != sizeof(one))
+		return 0;
+	for (i = 0; i < 1000; i++) {
+		if (__atomic_load_n(&hits[idx], __ATOMIC_SEQ_CST) != n)
+			return 1;
+		nanosleep(&ts, NULL);
+	}
+	return 0;
+}
+
+static void
+test_setup(void)
+{
+	unsigned int v;
+
+	/* the first call discovers the devices */
+	CHECK(rumpcomp_pci_confread(0, 0, 0, 0, &v) == 0);
+	CHECK(mock.groupattached);
+	CHECK(mock.iommutype == VFIO_TYPE1v2_IOMMU);
+	CHECK(mock.ndevfds == 1);
+
+	/* one device, in the first slot */
+	CHECK(v == 0x10d38086);
+	CHECK(rumpcomp_pci_confread(0, 1, 0, 0, &v) == 1);
+	CHECK(v == 0xffffffff);
+	CHECK(rumpcomp_pci_confread(1, 0, 0, 0, &v) == 1);
+}
+
+static void
+test_config(void)
+{
+	unsigned int v;
+	uint32_t reg;
+
+	CHECK(rumpcomp_pci_confwrite(0, 0, 0, 0x04, 0x00100406) == 0);
+	CHECK(pread(mock.devfd, &reg, sizeof(reg), 0x04) == sizeof(reg));
+	CHECK(reg == 0x00100406);
+	CHECK(rumpcomp_pci_confread(0, 0, 0, 0x04, &v) == 0);
+	CHECK(v == 0x00100406);
+}
+
+static void
+test_bar(void)
+{
+	volatile uint32_t *r, *r2;
+	uint32_t reg;
+
+	r = rumpcomp_pci_map(MOCK_BAR0BASE + 0x10, 16);
+	CHECK(r != NULL);
+	if (r == NULL)
+		return;
+	r[0] = 0xdeadbeef;
+	CHECK(pread(mock.devfd, &reg, sizeof(reg), MOCK_BAR0OFF + 0x10)
+	    == sizeof(reg));
+	CHECK(reg == 0xdeadbeef);
+
+	/* the BAR mapping is shared */
+	r2 = rumpcomp_pci_map(MOCK_BAR0BASE, 4);
+	CHECK((uintptr_t)r - (uintptr_t)r2 == 0x10);
+	rumpcomp_pci_unmap((void *)r2, 4);
+	CHECK(r[0] == 0xdeadbeef);
+	rumpcomp_pci_unmap((void *)r, 16);
+
+	CHECK(rumpcomp_pci_map(MOCK_BAR0BASE + MOCK_BAR0SIZE, 4) == NULL);
+}
+
+static void
+test_msix(void)
+{
+	int vec;
+
+	CHECK(rumpcomp_pci_irq_nvectors(0, 0, 0) == MOCK_NMSIX);
+	CHECK(rumpcomp_pci_irq_nvectors(0, 1, 0) == 0);
+	CHECK(rumpcomp_pci_irq_establish_vector(0, 0, 0, MOCK_NMSIX,
+	    handler, (void *)0) == NULL);
+
+	/* the first vector enables the whole block, others unrouted */
+	CHECK(rumpcomp_pci_irq_establish_vector(0, 0, 0, 2,
+	    handler, (void *)2) != NULL);
+	CHECK(mock.nmsixenabled == MOCK_NMSIX);
+	CHECK(mock.msixfd[2] != -1);
+	for (vec = 0; vec < MOCK_NMSIX; vec++) {
+		if (vec != 2)
+			CHECK(mock.msixfd[vec] == -1);
+	}
+
+	/* later vectors are routed one at a time */
+	CHECK(rumpcomp_pci_irq_establish_vector(0, 0, 0, 5,
+	    handler, (void *)5) != NULL);
+	CHECK(mock.nmsixsets == 2);
+	CHECK(mock.msixfd[5] != -1);
+	CHECK(mock.msixfd[5] != mock.msixfd[2]);
+
+	/* each vector reaches its own handler */
+	CHECK(fire(mock.msixfd[2], 2));
+	CHECK(hits[2] == 1 && hits[5] == 0);
+	CHECK(fire(mock.msixfd[5], 5));
+	CHECK(fire(mock.msixfd[5], 5));
+	CHECK(hits[2] == 1 && hits[5] == 2);
+}
+
+static void
+test_intx(void)
+{
+
+	CHECK(rumpcomp_pci_irq_map(0, 0, 0, 11, 42) == 0);
+	CHECK(rumpcomp_pci_irq_establish(43, handler,
+	    (void *)MOCK_NMSIX) == NULL);
+	CHECK(rumpcomp_pci_irq_establish(42, handler,
+	    (void *)MOCK_NMSIX) != NULL);
+	CHECK(mock.intxfd != -1);
+
+	/* VFIO masks INTx when it fires, the handler thread unmasks */
+	CHECK(fire(mock.intxfd, MOCK_NMSIX));
+	usleep(10000);
+	CHECK(mock.nunmask == 1);
+	CHECK(hits[2] == 1 && hits[5] == 2);
+}
+
+static void
+test_dma(void)
+{
+	const size_t pagesize = getpagesize();
+	const size_t len = (10000 + pagesize-1) & ~(pagesize-1);
+	unsigned long pa, va, pa2, va2, pa3, va3;
+	void *heap;
+	int nmaps;
+
+	CHECK(rumpcomp_pci_dmalloc(10000, 65536, &pa, &va) == 0);
+	CHECK(pa != 0 && (pa & 65535) == 0);
+	CHECK(mock.nmaps == 1);
+	CHECK(mock.lastmap.vaddr == va && mock.lastmap.iova == pa);
+	CHECK(mock.lastmap.size == len);
+	CHECK(rumpcomp_pci_virt_to_mach((void *)va) == pa);
+	CHECK(rumpcomp_pci_virt_to_mach((void *)(va + 5000)) == pa + 5000);
+	((volatile char *)va)[9999] = 1;
+
+	CHECK(rumpcomp_pci_dmalloc(100, 0, &pa2, &va2) == 0);
+	CHECK(mock.nmaps == 2);
+	CHECK(mock.lastmap.size == pagesize);
+	CHECK(pa2 + pagesize <= pa || pa2 >= pa + len);
+	CHECK(rumpcomp_pci_dmalloc(100, 3*pagesize, &pa3, &va3) == EINVAL);
+
+	/* other memory cannot be freed through dmafree */
+	heap = malloc(100);
+	nmaps = mock.nmaps;
+	rumpcomp_pci_dmafree((unsigned long)heap, 100);
+	CHECK(mock.nunmaps == 0);
+	CHECK(mock.nmaps == nmaps);
+	free(heap);
+
+	rumpcomp_pci_dmafree(va, 10000);
+	CHECK(mock.nunmaps == 1);
+	CHECK(mock.lastunmap.iova == pa && mock.lastunmap.size == len);
+	rumpcomp_pci_dmafree(va2, 100);
+	CHECK(mock.nunmaps == 2);
+	CHECK(mock.mapped == 0);
+
+	/* the IOVA range is reused */
+	CHECK(rumpcomp_pci_dmalloc(10000, 65536, &pa2, &va2) == 0);
+	CHECK(pa2 == pa);
+	rumpcomp_pci_dmafree(va2, 10000);
+	CHECK(mock.mapped == 0);
+}
+
+/* pages outside the arena are mapped on demand, at most IOMAP_PAGES */
+#define IOMAP_PAGES 4
+
+static void
+test_iomap(void)
+{
+	const size_t pagesize = getpagesize();
+	unsigned long iova[IOMAP_PAGES+1], iova2;
+	uint8_t *buf;
+	uint64_t mapped;
+	int i, nmaps, nunmaps;
+
+	buf = mmap(NULL, (IOMAP_PAGES+1) * pagesize, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANON, -1, 0);
+	CHECK(buf != MAP_FAILED);
+	if (buf == MAP_FAILED)
+		return;
+	nmaps = mock.nmaps;
+	nunmaps = mock.nunmaps;
+	mapped = mock.mapped;
+
+	iova[0] = rumpcomp_pci_virt_to_mach(buf + 100);
+	CHECK(iova[0] != 0 && (iova[0] & (pagesize-1)) == 100);
+	CHECK(mock.nmaps == nmaps+1);
+	CHECK(mock.lastmap.vaddr == (uintptr_t)buf);
+	CHECK(mock.lastmap.iova == iova[0] - 100);
+	CHECK(mock.lastmap.size == pagesize);
+
+	/* the page stays mapped */
+	CHECK(rumpcomp_pci_virt_to_mach(buf + 200) == iova[0] + 100);
+	CHECK(mock.nmaps == nmaps+1);
+
+	for (i = 1; i < IOMAP_PAGES; i++) {
+		iova[i] = rumpcomp_pci_virt_to_mach(buf + i*pagesize);
+		CHECK(iova[i] != 0);
+	}
+	CHECK(mock.nmaps == nmaps+IOMAP_PAGES);
+	CHECK(mock.nunmaps == nunmaps);
+
+	/* the next page evicts the least recently used one, page 1 */
+	CHECK(rumpcomp_pci_virt_to_mach(buf) == iova[0] - 100);
+	iova[IOMAP_PAGES] = rumpcomp_pci_virt_to_mach(buf
+	    + IOMAP_PAGES*pagesize);
+	CHECK(iova[IOMAP_PAGES] != 0);
+	CHECK(mock.nunmaps == nunmaps+1);
+	CHECK(mock.lastunmap.iova == iova[1]);
+	CHECK(mock.mapped == mapped + IOMAP_PAGES*pagesize);
+
+	/* and is mapped again when asked about */
+	iova2 = rumpcomp_pci_virt_to_mach(buf + pagesize);
+	CHECK(iova2 != 0);
+	CHECK(mock.nmaps == nmaps+IOMAP_PAGES+2);
+	CHECK(mock.nunmaps == nunmaps+2);
+	CHECK(mock.mapped == mapped + IOMAP_PAGES*pagesize);
+	CHECK(rumpcomp_pci_virt_to_mach(buf) == iova[0] - 100);
+}
+
+int
+main(void)
+{
+	char iomapmax[32];
+
+	snprintf(iomapmax, sizeof(iomapmax), "%d",
+	    IOMAP_PAGES * getpagesize());
+	setenv("RUMP_PCI_IOMAP_MAX", iomapmax, 1);
+	setenv("RUMP_PCI_DMA_ARENA", "64M", 1);
+	mock_init();
+
+	test_setup();
+	test_config();
+	test_bar();
+	test_msix();
+	test_intx();
+	test_dma();
+	test_iomap();
+
+	printf("vfiotest: %d failed\n", nfail);
+	return nfail;
+}